@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x86intrin.h>
+
+#include "src/charclass.h"
+
+/*
+** Microbenchmark of the Irset scan kernels. Every input is a sequence of
+** runs of one length, made of bytes in the class and each ended by one
+** byte that is not; a pass spans every run. The result is in bytes per
+** TSC cycle (reference cycles, not core cycles), best of the passes.
+*/
+
+#define BENCH_INPUT_SIZE (1 << 20)
+#define BENCH_PASSES 20
+
+typedef struct BenchClass {
+  const char *name;
+  const char *members;
+  char stop;
+} BenchClass;
+
+static const BenchClass bench_classes[] = {
+  { "space", " \t\r\n", 'x' },
+  { "digit", "0123456789", ' ' },
+  { "ident", "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_", ' ' },
+  { "string", "abcdefghijklmnopqrstuvwxyz ,.:;!?()[]{}<>", '"' },
+};
+
+static const unsigned bench_runs[] = { 1, 4, 16, 64, 256, 4096 };
+
+static const char *kernel_names[] = { "scalar", "ssse3", "avx2", "span" };
+
+/* charclass_span as the VM calls it, with the best kernel */
+#define BENCH_SPAN 3
+
+static int bench_best;
+
+static size_t spanWith(int kernel, const charclass_t *cc, const bitset_t *set, const char *s) {
+  switch (kernel) {
+  case BENCH_SPAN:
+    return charclass_span(bench_best, cc, set, s);
+  case CHARCLASS_AVX2:
+    return charclass_span_avx2(cc, s);
+  case CHARCLASS_SSSE3:
+    return charclass_span_ssse3(cc, s);
+  default:
+    return charclass_span_scalar(set, s);
+  }
+}
+
+/* returns the number of bytes spanned; *cycles gets the best pass */
+static size_t runPasses(int kernel, const charclass_t *cc, const bitset_t *set,
+    const char *input, size_t size, uint64_t *cycles) {
+  size_t spanned = 0;
+  int pass;
+  *cycles = UINT64_MAX;
+  for (pass = 0; pass < BENCH_PASSES; pass++) {
+    uint64_t start = __rdtsc(), end;
+    size_t pos = 0, n = 0;
+    while (pos < size) {
+      size_t len = spanWith(kernel, cc, set, input + pos);
+      n += len;
+      pos += len + 1;
+    }
+    end = __rdtsc();
+    if (end - start < *cycles) {
+      *cycles = end - start;
+    }
+    spanned = n;
+  }
+  return spanned;
+}
+
+int main(int argc, char *const argv[]) {
+  char *input = (char *)malloc(BENCH_INPUT_SIZE + 64);
+  int kernels[BENCH_SPAN + 1];
+  unsigned c, r, k, kernel_size = 0;
+  int kernel, ok = 1;
+  (void)argc;
+  (void)argv;
+  srand(1);
+  bench_best = charclass_select();
+  printf("charclass: %s kernel (bytes per TSC cycle)\n", kernel_names[bench_best]);
+  printf("%-8s %6s", "class", "run");
+  for (kernel = CHARCLASS_SCALAR; kernel <= bench_best; kernel++) {
+    kernels[kernel_size++] = kernel;
+  }
+  kernels[kernel_size++] = BENCH_SPAN;
+  for (k = 0; k < kernel_size; k++) {
+    printf(" %8s", kernel_names[kernels[k]]);
+  }
+  printf("\n");
+  for (c = 0; c < sizeof(bench_classes) / sizeof(bench_classes[0]); c++) {
+    const BenchClass *bc = &bench_classes[c];
+    size_t members = strlen(bc->members);
+    bitset_t set;
+    charclass_t cc;
+    bitset_init(&set);
+    for (r = 0; r < members; r++) {
+      bitset_set(&set, (unsigned char)bc->members[r]);
+    }
+    charclass_init(&cc, &set);
+    for (r = 0; r < sizeof(bench_runs) / sizeof(bench_runs[0]); r++) {
+      size_t size = 0, expected = 0;
+      while (size + bench_runs[r] + 1 <= BENCH_INPUT_SIZE) {
+        unsigned i;
+        for (i = 0; i < bench_runs[r]; i++) {
+          input[size++] = bc->members[rand() % members];
+        }
+        input[size++] = bc->stop;
+        expected += bench_runs[r];
+      }
+      memset(input + size, 0, 64);
+      printf("%-8s %6u", bc->name, bench_runs[r]);
+      for (k = 0; k < kernel_size; k++) {
+        uint64_t cycles;
+        size_t spanned = runPasses(kernels[k], &cc, &set, input, size, &cycles);
+        if (spanned != expected) {
+          ok = 0;
+        }
+        printf(" %8.3f", (double)size / (double)cycles);
+      }
+      printf("\n");
+    }
+  }
+  free(input);
+  if (!ok) {
+    fprintf(stderr, "charclass: kernels disagree with the scalar scan\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,17 @@
+# cmake -DMININEZ=<mininez> -DGRAMMAR=<bin> -DINPUT=<txt> -DEXPECTED=<dump>
+#       -DOUTPUT=<file> [-DFLAGS=<options>] -P dump.cmake
+# parses INPUT with -t ast and compares the tree with EXPECTED
+separate_arguments(FLAGS)
+execute_process(
+	COMMAND ${MININEZ} ${FLAGS} -p ${GRAMMAR} -i ${INPUT} -t ast -o ${OUTPUT}
+	RESULT_VARIABLE status
+	OUTPUT_QUIET ERROR_QUIET)
+if(NOT status EQUAL 0)
+	message(FATAL_ERROR "${INPUT}: mininez exited with ${status}")
+endif()
+execute_process(
+	COMMAND ${CMAKE_COMMAND} -E compare_files ${OUTPUT} ${EXPECTED}
+	RESULT_VARIABLE status)
+if(NOT status EQUAL 0)
+	message(FATAL_ERROR "${OUTPUT} differs from ${EXPECTED}")
+endif()
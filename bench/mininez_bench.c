@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <errno.h>
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "src/vm.h"
+
+/*
+** Parser benchmark. A manifest names pairs of grammar bytecode and input,
+** one per line as "<name> <grammar> <input>" with paths relative to the
+** manifest; blank lines and lines starting with '#' are skipped. Every
+** pair is parsed warmup times untimed and then iterations times, each
+** parse timed alone with CLOCK_MONOTONIC, by each engine: the interpreter
+** with its three dispatch loops (vm: indirect threading through the opcode
+** table, switch: a switch over the opcode, direct: direct-threaded code
+** from mininez_ThreadGrammar) and the JIT. bench/corpus/corpus.list is the
+** checked-in corpus:
+**
+**   mininez-bench -o before.json bench/corpus/corpus.list
+**
+** The results go to stdout (or -o) as JSON so runs on two commits can be
+** diffed; a one-line summary per run goes to stderr. dispatches counts
+** the instructions the interpreter dispatches for one parse, which is the
+** same for all engines as long as the bytecode is.
+**
+** With -c every timed parse is also wrapped in hardware counters from
+** perf_event_open (user space only): cycles, instructions, branch misses
+** and L1D read misses, reported per parse and per input byte. Counters
+** the kernel or the CPU does not provide are left out of the report, and
+** without any the benchmark runs as without -c.
+**
+** With -a every run is followed by one of the embedding API on the first
+** 100 bytes of the input: mininez_Parse on a fresh context, timed over
+** batches of calls, so the result is the cost of one call including the
+** copy of the input. Its status is reported but not checked, as a prefix
+** rarely parses.
+**
+** The interpreter keeps its backtrack frames in 32-bit words for inputs
+** under 4 GB. With -W the vm and switch engines also run with the 64-bit
+** frames, as vm-wide and switch-wide; a build with -DMININEZ_STACK_ENTRY=ON
+** lays those out as struct StackEntry instead of longs ("wide_frames" in
+** the JSON).
+**
+** With -R every pair is also parsed once with mininez_EnableReparse and
+** then timed on single-byte edits followed by mininez_Reparse, reported as
+** the reparse engine (its dispatches are not counted).
+*/
+
+#define BENCH_ENGINE_VM     1
+#define BENCH_ENGINE_JIT    2
+#define BENCH_ENGINE_SWITCH 4
+#define BENCH_ENGINE_DIRECT 8
+#define BENCH_ENGINE_ALL    15
+
+#define BENCH_API_INPUT 100
+#define BENCH_API_CALLS 1000
+
+typedef struct BenchEntry {
+  char *name;
+  char *grammar;
+  char *input;
+} BenchEntry;
+
+enum {
+  BENCH_CYCLES,
+  BENCH_INSTRUCTIONS,
+  BENCH_BRANCH_MISSES,
+  BENCH_L1D_MISSES,
+  BENCH_COUNTER_SIZE
+};
+
+static const char *counter_names[BENCH_COUNTER_SIZE] = {
+  "cycles", "instructions", "branch_misses", "l1d_misses"
+};
+
+/* one perf_event group; slot[i] is the place of counter i in a group read */
+typedef struct BenchCounters {
+  int leader;
+  int fds[BENCH_COUNTER_SIZE];
+  int slot[BENCH_COUNTER_SIZE];
+  int size;
+} BenchCounters;
+
+typedef struct BenchResult {
+  const char *status;
+  /* per parse; counted[i] is 0 when counter i is not available */
+  double counters[BENCH_COUNTER_SIZE];
+  int counted[BENCH_COUNTER_SIZE];
+  uint64_t min_ns;
+  uint64_t median_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t max_ns;
+  double mean_ns;
+} BenchResult;
+
+static uint64_t benchClock() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+#ifdef __linux__
+static int openCounter(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group == -1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP
+      | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+#endif
+
+static void initCounters(BenchCounters *c) {
+  int i;
+  c->leader = -1;
+  c->size = 0;
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    c->fds[i] = -1;
+    c->slot[i] = -1;
+  }
+}
+
+/* returns the number of counters opened; 0 leaves the benchmark untouched */
+static int openCounters(BenchCounters *c) {
+  int i;
+  initCounters(c);
+#ifdef __linux__
+  {
+    static const uint32_t types[BENCH_COUNTER_SIZE] = {
+      PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+    };
+    static const uint64_t configs[BENCH_COUNTER_SIZE] = {
+      PERF_COUNT_HW_CPU_CYCLES,
+      PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES,
+      PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+          | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+    };
+    int error = 0;
+    for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+      int fd = openCounter(types[i], configs[i], c->leader);
+      if (fd < 0) {
+        error = errno;
+        fprintf(stderr, "counters: %s is not available (%s)\n", counter_names[i], strerror(error));
+        continue;
+      }
+      if (c->leader == -1) {
+        c->leader = fd;
+      }
+      c->fds[i] = fd;
+      c->slot[i] = c->size++;
+    }
+    if (c->size == 0 && (error == EACCES || error == EPERM)) {
+      fprintf(stderr, "counters: see /proc/sys/kernel/perf_event_paranoid\n");
+    }
+  }
+#else
+  fprintf(stderr, "counters: perf_event_open is only available on Linux\n");
+#endif
+  return c->size;
+}
+
+static void closeCounters(BenchCounters *c) {
+#ifdef __linux__
+  int i;
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    if (c->fds[i] >= 0) {
+      close(c->fds[i]);
+    }
+  }
+#endif
+  initCounters(c);
+}
+
+static void startCounters(BenchCounters *c) {
+#ifdef __linux__
+  if (c->size > 0) {
+    ioctl(c->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(c->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+#endif
+}
+
+/* adds the counts since startCounters, scaled up if the group was multiplexed */
+static void stopCounters(BenchCounters *c, double *sums) {
+#ifdef __linux__
+  uint64_t buf[3 + BENCH_COUNTER_SIZE];
+  double scale = 1.0;
+  int i;
+  if (c->size == 0) {
+    return;
+  }
+  ioctl(c->leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+  if (read(c->leader, buf, sizeof(buf)) < (ssize_t)(sizeof(uint64_t) * (3 + c->size))) {
+    return;
+  }
+  if (buf[2] > 0 && buf[2] < buf[1]) {
+    scale = (double)buf[1] / (double)buf[2];
+  }
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    if (c->slot[i] >= 0) {
+      sums[i] += (double)buf[3 + c->slot[i]] * scale;
+    }
+  }
+#else
+  (void)c;
+  (void)sums;
+#endif
+}
+
+static int compareNs(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* nearest-rank percentile of sorted samples */
+static uint64_t percentile(const uint64_t *ns, size_t size, double p) {
+  size_t rank = (size_t)(p * (double)size + 0.999999);
+  return ns[rank > 0 ? rank - 1 : 0];
+}
+
+static char *joinPath(const char *dir, size_t dir_len, const char *path) {
+  char *buf;
+  if (path[0] == '/' || dir_len == 0) {
+    return strdup(path);
+  }
+  buf = (char *)malloc(dir_len + strlen(path) + 1);
+  memcpy(buf, dir, dir_len);
+  strcpy(buf + dir_len, path);
+  return buf;
+}
+
+static BenchEntry *readManifest(const char *manifest, size_t *length) {
+  FILE *fp = fopen(manifest, "r");
+  const char *slash = strrchr(manifest, '/');
+  size_t dir_len = slash ? (size_t)(slash - manifest + 1) : 0;
+  BenchEntry *entries = NULL;
+  size_t size = 0, capacity = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  if (fp == NULL) {
+    nez_PrintErrorInfo("fopen error: cannot open benchmark manifest");
+  }
+  while (getline(&line, &line_capacity, fp) != -1) {
+    char name[256], grammar[1024], input[1024];
+    if (line[0] == '#' || sscanf(line, "%255s %1023s %1023s", name, grammar, input) != 3) {
+      continue;
+    }
+    if (size == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      entries = (BenchEntry *)realloc(entries, sizeof(BenchEntry) * capacity);
+    }
+    entries[size].name = strdup(name);
+    entries[size].grammar = joinPath(manifest, dir_len, grammar);
+    entries[size].input = joinPath(manifest, dir_len, input);
+    size++;
+  }
+  free(line);
+  fclose(fp);
+  *length = size;
+  return entries;
+}
+
+static const char *parseStatus(Context ctx, long result) {
+  if (result == MININEZ_STACK_OVERFLOW) {
+    return "overflow";
+  }
+  if (!result) {
+    return "fail";
+  }
+  return ctx->pos == (long)ctx->input_size ? "match" : "unconsumed";
+}
+
+static void runBench(Context ctx, BenchCounters *counters, int warmup, int iterations,
+    uint64_t *ns, BenchResult *r) {
+  Grammar g = ctx->grammar;
+  double total = 0;
+  double sums[BENCH_COUNTER_SIZE] = { 0 };
+  long result = 0;
+  int i;
+  for (i = 0; i < warmup; i++) {
+    mininez_vm_execute(ctx, g->inst);
+  }
+  for (i = 0; i < iterations; i++) {
+    uint64_t start;
+    startCounters(counters);
+    start = benchClock();
+    result = mininez_vm_execute(ctx, g->inst);
+    ns[i] = benchClock() - start;
+    stopCounters(counters, sums);
+    total += (double)ns[i];
+  }
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    r->counted[i] = counters->slot[i] >= 0;
+    r->counters[i] = sums[i] / iterations;
+  }
+  qsort(ns, (size_t)iterations, sizeof(uint64_t), compareNs);
+  r->status = parseStatus(ctx, result);
+  r->min_ns = ns[0];
+  r->median_ns = percentile(ns, (size_t)iterations, 0.50);
+  r->p90_ns = percentile(ns, (size_t)iterations, 0.90);
+  r->p99_ns = percentile(ns, (size_t)iterations, 0.99);
+  r->max_ns = ns[iterations - 1];
+  r->mean_ns = total / iterations;
+}
+
+static const char *apiStatus(int status) {
+  switch (status) {
+  case MININEZ_MATCH:
+    return "match";
+  case MININEZ_NOMATCH:
+    return "fail";
+  case MININEZ_PARTIAL:
+    return "unconsumed";
+  case MININEZ_OVERFLOW:
+    return "overflow";
+  default:
+    return "error";
+  }
+}
+
+/* every sample is the mean of BENCH_API_CALLS calls */
+static void runApiBench(Context ctx, BenchCounters *counters, const char *input, size_t length,
+    int warmup, int iterations, uint64_t *ns, BenchResult *r) {
+  double total = 0;
+  double sums[BENCH_COUNTER_SIZE] = { 0 };
+  int status = MININEZ_ERROR;
+  int i, k;
+  for (i = 0; i < warmup; i++) {
+    mininez_Parse(ctx, input, length);
+  }
+  for (i = 0; i < iterations; i++) {
+    uint64_t start;
+    startCounters(counters);
+    start = benchClock();
+    for (k = 0; k < BENCH_API_CALLS; k++) {
+      status = mininez_Parse(ctx, input, length);
+    }
+    ns[i] = (benchClock() - start) / BENCH_API_CALLS;
+    stopCounters(counters, sums);
+    total += (double)ns[i];
+  }
+  qsort(ns, (size_t)iterations, sizeof(uint64_t), compareNs);
+  r->status = apiStatus(status);
+  r->min_ns = ns[0];
+  r->median_ns = percentile(ns, (size_t)iterations, 0.50);
+  r->p90_ns = percentile(ns, (size_t)iterations, 0.90);
+  r->p99_ns = percentile(ns, (size_t)iterations, 0.99);
+  r->max_ns = ns[iterations - 1];
+  r->mean_ns = total / iterations;
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    r->counted[i] = counters->slot[i] >= 0;
+    r->counters[i] = sums[i] / ((double)iterations * BENCH_API_CALLS);
+  }
+}
+
+/*
+** Each timed call replaces one byte of the input with itself, at positions
+** spread over the document, and reparses; the edit drops the results that
+** examined the byte all the same.
+*/
+static void runReparseBench(Context ctx, BenchCounters *counters, int warmup, int iterations,
+    uint64_t *ns, BenchResult *r) {
+  double total = 0;
+  double sums[BENCH_COUNTER_SIZE] = { 0 };
+  size_t length = ctx->input_size;
+  int status = MININEZ_ERROR;
+  int i;
+  for (i = -warmup; i < iterations; i++) {
+    uint64_t start;
+    startCounters(counters);
+    start = benchClock();
+    if (length > 0) {
+      size_t pos = (size_t)(((uint64_t)(i + warmup) * 2654435761U) % length);
+      char byte = ctx->inputs[pos];
+      mininez_Edit(ctx, pos, 1, &byte, 1);
+    }
+    status = mininez_Reparse(ctx);
+    if (i < 0) {
+      continue;
+    }
+    ns[i] = benchClock() - start;
+    stopCounters(counters, sums);
+    total += (double)ns[i];
+  }
+  qsort(ns, (size_t)iterations, sizeof(uint64_t), compareNs);
+  r->status = apiStatus(status);
+  r->min_ns = ns[0];
+  r->median_ns = percentile(ns, (size_t)iterations, 0.50);
+  r->p90_ns = percentile(ns, (size_t)iterations, 0.90);
+  r->p99_ns = percentile(ns, (size_t)iterations, 0.99);
+  r->max_ns = ns[iterations - 1];
+  r->mean_ns = total / iterations;
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    r->counted[i] = counters->slot[i] >= 0;
+    r->counters[i] = sums[i] / iterations;
+  }
+}
+
+static void printJsonString(FILE *fp, const char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') {
+      fprintf(fp, "\\%c", *s);
+    } else if ((unsigned char)*s < 0x20) {
+      fprintf(fp, "\\u%04x", (unsigned char)*s);
+    } else {
+      fputc(*s, fp);
+    }
+  }
+  fputc('"', fp);
+}
+
+/* "counters": {"cycles": {"per_parse": ..., "per_byte": ...}, ...} */
+static void printCounters(FILE *fp, size_t bytes, const BenchResult *r) {
+  double per_byte[BENCH_COUNTER_SIZE];
+  int i, printed = 0;
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    per_byte[i] = bytes > 0 ? r->counters[i] / (double)bytes : 0.0;
+    if (!r->counted[i]) {
+      continue;
+    }
+    fprintf(fp, "%s\"%s\": {\"per_parse\": %.0f, \"per_byte\": %.4f}",
+        printed ? ", " : ",\n     \"counters\": {", counter_names[i], r->counters[i], per_byte[i]);
+    printed = 1;
+  }
+  if (!printed) {
+    return;
+  }
+  fprintf(fp, "}");
+  fprintf(stderr, "%16s", "");
+  for (i = 0; i < BENCH_COUNTER_SIZE; i++) {
+    if (r->counted[i]) {
+      fprintf(stderr, "  %.3f %s/byte", per_byte[i], counter_names[i]);
+    }
+  }
+  if (r->counted[BENCH_CYCLES] && r->counted[BENCH_INSTRUCTIONS] && r->counters[BENCH_CYCLES] > 0) {
+    fprintf(stderr, "  IPC %.2f", r->counters[BENCH_INSTRUCTIONS] / r->counters[BENCH_CYCLES]);
+  }
+  fprintf(stderr, "\n");
+}
+
+static void printResult(FILE *fp, int first, const BenchEntry *e, const char *engine,
+    size_t bytes, size_t dispatches, int iterations, const BenchResult *r) {
+  double seconds = (double)r->median_ns / 1e9;
+  double mb_per_sec = seconds > 0 ? (double)bytes / (1024.0 * 1024.0) / seconds : 0.0;
+  double per_byte = bytes > 0 ? (double)dispatches / (double)bytes : 0.0;
+  fprintf(fp, "%s\n    {\"name\": ", first ? "" : ",");
+  printJsonString(fp, e->name);
+  fprintf(fp, ", \"engine\": \"%s\", \"status\": \"%s\",\n", engine, r->status);
+  fprintf(fp, "     \"grammar\": ");
+  printJsonString(fp, e->grammar);
+  fprintf(fp, ", \"input\": ");
+  printJsonString(fp, e->input);
+  fprintf(fp, ", \"input_bytes\": %zu,\n", bytes);
+  fprintf(fp, "     \"iterations\": %d, \"min_ns\": %llu, \"median_ns\": %llu, "
+      "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, \"mean_ns\": %.0f,\n",
+      iterations, (unsigned long long)r->min_ns, (unsigned long long)r->median_ns,
+      (unsigned long long)r->p90_ns, (unsigned long long)r->p99_ns,
+      (unsigned long long)r->max_ns, r->mean_ns);
+  fprintf(fp, "     \"mb_per_sec\": %.2f, \"dispatches\": %zu, \"dispatches_per_byte\": %.3f",
+      mb_per_sec, dispatches, per_byte);
+  fprintf(stderr, "%-12s %-11s %-10s median %12.3f us  p90 %12.3f us  p99 %12.3f us  %9.2f MB/s  %6.3f dispatch/byte\n",
+      e->name, engine, r->status, r->median_ns / 1e3, r->p90_ns / 1e3, r->p99_ns / 1e3,
+      mb_per_sec, per_byte);
+  printCounters(fp, bytes, r);
+  fprintf(fp, "}");
+}
+
+/* one engine on one pair; with api, then the API call on a prefix of the input */
+static int benchEngine(FILE *out, int *first, const BenchEntry *e, const char *engine,
+    Context ctx, size_t dispatches, BenchCounters *counters, int warmup, int iterations,
+    int api, uint64_t *ns) {
+  BenchResult r;
+  int failed;
+  runBench(ctx, counters, warmup, iterations, ns, &r);
+  printResult(out, *first, e, engine, ctx->input_size, dispatches, iterations, &r);
+  *first = 0;
+  failed = strcmp(r.status, "match") != 0;
+  if (api) {
+    Context api_ctx = mininez_CreateContext(ctx->grammar);
+    size_t length = ctx->input_size < BENCH_API_INPUT ? ctx->input_size : BENCH_API_INPUT;
+    char name[16];
+    if (api_ctx == NULL) {
+      nez_PrintErrorInfo("mmap error: cannot reserve the backtrack stack");
+    }
+    api_ctx->dispatch = ctx->dispatch;
+    api_ctx->frames = ctx->frames;
+    api_ctx->count_dispatch = 1;
+    mininez_Parse(api_ctx, ctx->inputs, length);
+    api_ctx->count_dispatch = 0;
+    dispatches = api_ctx->dispatch_count;
+    runApiBench(api_ctx, counters, ctx->inputs, length, warmup, iterations, ns, &r);
+    snprintf(name, sizeof(name), "%s-api", engine);
+    printResult(out, 0, e, name, length, dispatches, iterations, &r);
+    mininez_DisposeContext(api_ctx);
+  }
+  return failed;
+}
+
+static void benchShowUsage(const char *file) {
+  fprintf(stderr, "\n%s [options] <manifest>...\n", file);
+  fprintf(stderr, "  -w <count>    Untimed parses before measuring (default: 3)\n");
+  fprintf(stderr, "  -n <count>    Timed parses per grammar and engine (default: 30)\n");
+  fprintf(stderr, "  -O <level>    Optimize the loaded bytecode (0: load it as is, default: 1)\n");
+  fprintf(stderr, "  -I <size>     Inline nonterminals of up to <size> instructions (0: none, default: 8)\n");
+  fprintf(stderr, "  -e <engine>   vm, switch, direct, jit or all (default: all)\n");
+  fprintf(stderr, "  -o <filename> Write the JSON results to a file instead of stdout\n");
+  fprintf(stderr, "  -c            Count cycles, instructions, branch and L1D misses per parse\n");
+  fprintf(stderr, "  -a            Also time the API call (mininez_Parse) on a 100-byte prefix\n");
+  fprintf(stderr, "  -W            Also run vm and switch with the 64-bit backtrack frames\n");
+  fprintf(stderr, "  -R            Also time a one-byte edit and mininez_Reparse\n");
+  fprintf(stderr, "  -h            Display this help and exit\n\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *const argv[]) {
+  const char *output_file = NULL;
+  int warmup = 3;
+  int iterations = 30;
+  int optimize = 1;
+  int inline_size = -1;
+  int engines = BENCH_ENGINE_ALL;
+  int failed = 0, first = 1;
+  int use_counters = 0;
+  int api = 0;
+  int wide = 0;
+  int reparse = 0;
+  BenchCounters counters;
+  uint64_t *ns;
+  FILE *out = stdout;
+  int opt, m;
+  while ((opt = getopt(argc, argv, "w:n:O:I:e:o:caWRh")) != -1) {
+    switch (opt) {
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 'n':
+      iterations = atoi(optarg);
+      break;
+    case 'O':
+      optimize = atoi(optarg);
+      break;
+    case 'I':
+      inline_size = atoi(optarg);
+      break;
+    case 'e':
+      if (strcmp(optarg, "vm") == 0) {
+        engines = BENCH_ENGINE_VM;
+      } else if (strcmp(optarg, "switch") == 0) {
+        engines = BENCH_ENGINE_SWITCH;
+      } else if (strcmp(optarg, "direct") == 0) {
+        engines = BENCH_ENGINE_DIRECT;
+      } else if (strcmp(optarg, "jit") == 0) {
+        engines = BENCH_ENGINE_JIT;
+      } else if (strcmp(optarg, "all") == 0) {
+        engines = BENCH_ENGINE_ALL;
+      } else {
+        benchShowUsage(argv[0]);
+      }
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
+    case 'c':
+      use_counters = 1;
+      break;
+    case 'a':
+      api = 1;
+      break;
+    case 'W':
+      wide = 1;
+      break;
+    case 'R':
+      reparse = 1;
+      break;
+    default:
+      benchShowUsage(argv[0]);
+    }
+  }
+  if (optind >= argc || iterations <= 0 || warmup < 0) {
+    benchShowUsage(argv[0]);
+  }
+  if (output_file != NULL && (out = fopen(output_file, "w")) == NULL) {
+    nez_PrintErrorInfo("fopen error: cannot open output file");
+  }
+  ns = (uint64_t *)malloc(sizeof(uint64_t) * (size_t)iterations);
+  initCounters(&counters);
+  if (use_counters && openCounters(&counters) == 0) {
+    fprintf(stderr, "counters: none available; measuring time only\n");
+  }
+
+  fprintf(out, "{\"revision\": ");
+#ifdef MININEZ_REVISION
+  printJsonString(out, MININEZ_REVISION);
+#else
+  fprintf(out, "null");
+#endif
+  fprintf(out, ", \"optimize\": %d, \"inline\": %d, \"warmup\": %d, \"iterations\": %d,\n",
+      optimize, inline_size < 0 ? MININEZ_INLINE_DEFAULT : inline_size, warmup, iterations);
+  fprintf(out, "  \"wide_frames\": \"%s\", \"results\": [",
+      USE_STACK_ENTRY == 1 ? "StackEntry" : "long");
+  for (m = optind; m < argc; m++) {
+    size_t size, i;
+    BenchEntry *entries = readManifest(argv[m], &size);
+    for (i = 0; i < size; i++) {
+      BenchEntry *e = &entries[i];
+      Grammar g = loadMachineCode(e->grammar, NULL, 0, optimize, inline_size);
+      Context ctx = mininez_CreateContext(g);
+      size_t dispatches;
+      if (ctx == NULL) {
+        nez_PrintErrorInfo("mmap error: cannot reserve the backtrack stack");
+      }
+      mininez_EnableStackGuard(ctx);
+      if (!mininez_LoadInput(ctx, e->input)) {
+        nez_PrintErrorInfo("open error: cannot open file");
+      }
+      ctx->count_dispatch = 1;
+      mininez_vm_execute(ctx, g->inst);
+      ctx->count_dispatch = 0;
+      dispatches = ctx->dispatch_count;
+      if (engines & BENCH_ENGINE_VM) {
+        ctx->dispatch = MININEZ_DISPATCH_INDIRECT;
+        failed |= benchEngine(out, &first, e, "vm", ctx, dispatches, &counters,
+            warmup, iterations, api, ns);
+        if (wide) {
+          ctx->frames = MININEZ_FRAMES_WIDE;
+          failed |= benchEngine(out, &first, e, "vm-wide", ctx, dispatches, &counters,
+              warmup, iterations, api, ns);
+          ctx->frames = MININEZ_FRAMES_DEFAULT;
+        }
+      }
+      if (engines & BENCH_ENGINE_SWITCH) {
+        ctx->dispatch = MININEZ_DISPATCH_SWITCH;
+        failed |= benchEngine(out, &first, e, "switch", ctx, dispatches, &counters,
+            warmup, iterations, api, ns);
+        if (wide) {
+          ctx->frames = MININEZ_FRAMES_WIDE;
+          failed |= benchEngine(out, &first, e, "switch-wide", ctx, dispatches, &counters,
+              warmup, iterations, api, ns);
+          ctx->frames = MININEZ_FRAMES_DEFAULT;
+        }
+      }
+      if (engines & BENCH_ENGINE_DIRECT) {
+        if (!mininez_ThreadGrammar(g)) {
+          nez_PrintErrorInfo("malloc error: cannot translate to direct-threaded code");
+        }
+        ctx->dispatch = MININEZ_DISPATCH_DIRECT;
+        failed |= benchEngine(out, &first, e, "direct", ctx, dispatches, &counters,
+            warmup, iterations, api, ns);
+      }
+      if (reparse) {
+        Context rctx = mininez_CreateContext(g);
+        BenchResult r;
+        if (rctx == NULL) {
+          nez_PrintErrorInfo("mmap error: cannot reserve the backtrack stack");
+        }
+        if (!mininez_EnableReparse(rctx)) {
+          nez_PrintErrorInfo("malloc error: cannot keep the results for reparsing");
+        }
+        mininez_Parse(rctx, ctx->inputs, ctx->input_size);
+        runReparseBench(rctx, &counters, warmup, iterations, ns, &r);
+        printResult(out, first, e, "reparse", ctx->input_size, 0, iterations, &r);
+        first = 0;
+        failed |= strcmp(r.status, "match") != 0;
+        mininez_DisposeContext(rctx);
+      }
+      if (engines & BENCH_ENGINE_JIT) {
+        ctx->dispatch = MININEZ_DISPATCH_DEFAULT;
+        if (mininez_CompileGrammar(g)) {
+          failed |= benchEngine(out, &first, e, "jit", ctx, dispatches, &counters,
+              warmup, iterations, api, ns);
+        } else {
+          fprintf(stderr, "%s: jit is not available; skipped\n", e->name);
+        }
+      }
+      mininez_DisposeContext(ctx);
+      mininez_DisposeGrammar(g);
+      free(e->name);
+      free(e->grammar);
+      free(e->input);
+    }
+    free(entries);
+  }
+  fprintf(out, "\n  ]\n}\n");
+  closeCounters(&counters);
+  if (out != stdout) {
+    fclose(out);
+  }
+  free(ns);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
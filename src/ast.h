@@ -0,0 +1,230 @@
+/****************************************************************************
+ * Copyright (c) 2015, Masahiro Ide <imasahiro9 at gmail.com>
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ ***************************************************************************/
+
+#ifndef AST_H
+#define AST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+** Parse tree construction.
+** While parsing, Inew/Itag/Ilink/Icapture only append to an operation log.
+** Alt frames remember the log size, so backtracking truncates the log and
+** a discarded alternative never allocates a node. After a successful parse
+** ast_build replays the log into nodes taken from a bump-pointer arena.
+** Nodes refer to each other by index; ast_reset frees the whole tree in
+** O(1) and keeps the memory for the next document.
+*/
+
+#define AST_NONE     (~0U)
+#define AST_TAG_NONE (~0U)
+
+enum ast_log_op {
+    AST_LOG_NEW,
+    AST_LOG_TAG,
+    AST_LOG_LINK,
+    AST_LOG_CAPTURE
+};
+
+typedef struct AstLogEntry {
+    unsigned op;
+    long value;
+} AstLogEntry;
+
+typedef struct AstNode {
+    long start;
+    long end;
+    unsigned tag;
+    unsigned first_child;
+    unsigned last_child;
+    unsigned next_sibling;
+} AstNode;
+
+typedef struct AstTree {
+    AstLogEntry *log;
+    size_t log_size;
+    size_t log_capacity;
+    AstNode *nodes;
+    size_t node_size;
+    size_t node_capacity;
+    unsigned *open;
+    size_t open_capacity;
+    unsigned root;
+} AstTree;
+
+static inline AstTree *ast_init(void)
+{
+    AstTree *ast = (AstTree *)malloc(sizeof(AstTree));
+    ast->log_capacity = 1024;
+    ast->log = (AstLogEntry *)malloc(sizeof(AstLogEntry) * ast->log_capacity);
+    ast->log_size = 0;
+    ast->node_capacity = 256;
+    ast->nodes = (AstNode *)malloc(sizeof(AstNode) * ast->node_capacity);
+    ast->node_size = 0;
+    ast->open_capacity = 64;
+    ast->open = (unsigned *)malloc(sizeof(unsigned) * ast->open_capacity);
+    ast->root = AST_NONE;
+    return ast;
+}
+
+static inline void ast_dispose(AstTree *ast)
+{
+    free(ast->log);
+    free(ast->nodes);
+    free(ast->open);
+    free(ast);
+}
+
+static inline void ast_reset(AstTree *ast)
+{
+    ast->log_size = 0;
+    ast->node_size = 0;
+    ast->root = AST_NONE;
+}
+
+static inline void ast_log(AstTree *ast, unsigned op, long value)
+{
+    if (ast->log_size == ast->log_capacity) {
+        ast->log_capacity *= 2;
+        ast->log = (AstLogEntry *)realloc(ast->log, sizeof(AstLogEntry) * ast->log_capacity);
+    }
+    ast->log[ast->log_size].op = op;
+    ast->log[ast->log_size].value = value;
+    ast->log_size++;
+}
+
+static inline void ast_rollback(AstTree *ast, size_t log_size)
+{
+    ast->log_size = log_size;
+}
+
+static inline unsigned ast_new_node(AstTree *ast, long pos)
+{
+    AstNode *node;
+    if (ast->node_size == ast->node_capacity) {
+        ast->node_capacity *= 2;
+        ast->nodes = (AstNode *)realloc(ast->nodes, sizeof(AstNode) * ast->node_capacity);
+    }
+    node = &ast->nodes[ast->node_size];
+    node->start = node->end = pos;
+    node->tag = AST_TAG_NONE;
+    node->first_child = node->last_child = node->next_sibling = AST_NONE;
+    return (unsigned)ast->node_size++;
+}
+
+static inline void ast_build(AstTree *ast)
+{
+    size_t i, top = 0;
+    unsigned last = AST_NONE;
+    for (i = 0; i < ast->log_size; i++) {
+        AstLogEntry *e = &ast->log[i];
+        switch (e->op) {
+        case AST_LOG_NEW:
+            if (top == ast->open_capacity) {
+                ast->open_capacity *= 2;
+                ast->open = (unsigned *)realloc(ast->open, sizeof(unsigned) * ast->open_capacity);
+            }
+            ast->open[top++] = ast_new_node(ast, e->value);
+            break;
+        case AST_LOG_TAG:
+            if (top > 0) {
+                ast->nodes[ast->open[top - 1]].tag = (unsigned)e->value;
+            }
+            break;
+        case AST_LOG_CAPTURE:
+            if (top > 0) {
+                last = ast->open[--top];
+                ast->nodes[last].end = e->value;
+            }
+            break;
+        case AST_LOG_LINK:
+            if (top > 0 && last != AST_NONE) {
+                AstNode *parent = &ast->nodes[ast->open[top - 1]];
+                if (parent->last_child == AST_NONE) {
+                    parent->first_child = last;
+                }
+                else {
+                    ast->nodes[parent->last_child].next_sibling = last;
+                }
+                parent->last_child = last;
+                last = AST_NONE;
+            }
+            break;
+        }
+    }
+    ast->root = last;
+}
+
+static inline void ast_dump_node(AstTree *ast, unsigned index, const char *inputs,
+        const char **tags, unsigned tag_size, unsigned depth, FILE *fp)
+{
+    AstNode *node = &ast->nodes[index];
+    unsigned i;
+    for (i = 0; i < depth; i++) {
+        fputs("  ", fp);
+    }
+    if (node->tag < tag_size) {
+        fprintf(fp, "#%s[", tags[node->tag]);
+    }
+    else {
+        fputs("#[", fp);
+    }
+    if (node->first_child == AST_NONE) {
+        long p;
+        fputc('\'', fp);
+        for (p = node->start; p < node->end; p++) {
+            unsigned char ch = (unsigned char)inputs[p];
+            if (ch == '\'' || ch == '\\') {
+                fprintf(fp, "\\%c", ch);
+            }
+            else if (ch < 32 || ch > 126) {
+                fprintf(fp, "\\x%02x", ch);
+            }
+            else {
+                fputc(ch, fp);
+            }
+        }
+        fputs("']\n", fp);
+        return;
+    }
+    fputc('\n', fp);
+    for (i = node->first_child; i != AST_NONE; i = ast->nodes[i].next_sibling) {
+        ast_dump_node(ast, i, inputs, tags, tag_size, depth + 1, fp);
+    }
+    for (i = 0; i < depth; i++) {
+        fputs("  ", fp);
+    }
+    fputs("]\n", fp);
+}
+
+static inline void ast_dump(AstTree *ast, const char *inputs,
+        const char **tags, unsigned tag_size, FILE *fp)
+{
+    if (ast->root != AST_NONE) {
+        ast_dump_node(ast, ast->root, inputs, tags, tag_size, 0, fp);
+    }
+}
+
+#endif /* end of include guard */
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h> // gettimeofday
+
+#include "vm.h"
+
+/*
+** Batch mode: parse a list of files on a pool of threads. The Grammar is
+** shared read-only; every worker has its own Context, so the only shared
+** mutable state is the work queues.
+**
+** Files are sorted by size, largest first, and dealt round-robin to the
+** workers' deques. A worker takes work from the front of its own deque,
+** largest file first. When it runs dry it steals from the back of another
+** worker's deque, so a thief and the owner rarely want the same entry and
+** a few huge files do not leave the other cores idle at the end.
+*/
+
+typedef struct BatchFile {
+  char *path;
+  size_t size;
+} BatchFile;
+
+typedef struct BatchQueue {
+  pthread_mutex_t lock;
+  BatchFile **files;
+  size_t head;
+  size_t tail;
+} BatchQueue;
+
+struct Batch;
+
+typedef struct BatchWorker {
+  pthread_t thread;
+  struct Batch *batch;
+  unsigned id;
+  BatchQueue queue;
+  size_t bytes;
+  size_t matched;
+  size_t failed;
+  size_t stolen;
+  int started;
+  /* why the worker could not parse; its files are left to the others */
+  const char *error;
+} BatchWorker;
+
+typedef struct Batch {
+  Grammar grammar;
+  BatchWorker *workers;
+  unsigned worker_size;
+  size_t memo_window;
+  size_t stream_window;
+} Batch;
+
+static uint64_t batchTimer() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static int compareFileSize(const void *a, const void *b) {
+  const BatchFile *fa = (const BatchFile *)a;
+  const BatchFile *fb = (const BatchFile *)b;
+  if (fa->size == fb->size) {
+    return 0;
+  }
+  return fa->size < fb->size ? 1 : -1;
+}
+
+/* one path per line; blank lines are skipped */
+static BatchFile *readFileList(const char *list_file, size_t *length, size_t *missing) {
+  FILE *fp = fopen(list_file, "r");
+  BatchFile *files = NULL;
+  size_t size = 0, capacity = 0;
+  char *line = NULL;
+  size_t line_capacity = 0;
+  ssize_t len;
+  if (fp == NULL) {
+    nez_PrintErrorInfo("fopen error: cannot open file list");
+  }
+  *missing = 0;
+  while ((len = getline(&line, &line_capacity, fp)) != -1) {
+    struct stat st;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = 0;
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (stat(line, &st) != 0) {
+      fprintf(stderr, "%s: cannot stat file\n", line);
+      (*missing)++;
+      continue;
+    }
+    if (size == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      files = (BatchFile *)realloc(files, sizeof(BatchFile) * capacity);
+    }
+    files[size].path = strdup(line);
+    files[size].size = (size_t)st.st_size;
+    size++;
+  }
+  free(line);
+  fclose(fp);
+  *length = size;
+  return files;
+}
+
+static BatchFile *popFront(BatchQueue *q) {
+  BatchFile *file = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    file = q->files[q->head++];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return file;
+}
+
+static BatchFile *popBack(BatchQueue *q) {
+  BatchFile *file = NULL;
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail) {
+    file = q->files[--q->tail];
+  }
+  pthread_mutex_unlock(&q->lock);
+  return file;
+}
+
+static BatchFile *nextFile(BatchWorker *w) {
+  Batch *batch = w->batch;
+  BatchFile *file = popFront(&w->queue);
+  unsigned i;
+  for (i = 1; file == NULL && i < batch->worker_size; i++) {
+    file = popBack(&batch->workers[(w->id + i) % batch->worker_size].queue);
+    if (file != NULL) {
+      w->stolen++;
+    }
+  }
+  return file;
+}
+
+static void *batchWorker(void *arg) {
+  BatchWorker *w = (BatchWorker *)arg;
+  Grammar g = w->batch->grammar;
+  Context ctx = mininez_CreateContext(g);
+  BatchFile *file;
+  if (ctx == NULL) {
+    w->error = "mmap error: cannot reserve the backtrack stack";
+    return NULL;
+  }
+  mininez_EnableStackGuard(ctx);
+  if (w->batch->memo_window > 0) {
+    mininez_InitMemo(ctx, w->batch->memo_window);
+  }
+  while ((file = nextFile(w)) != NULL) {
+    long result;
+    if (!mininez_LoadInput(ctx, file->path)) {
+      fprintf(stderr, "%s: cannot read file\n", file->path);
+      w->failed++;
+      continue;
+    }
+    if (w->batch->stream_window > 0) {
+      mininez_EnableStream(ctx, w->batch->stream_window);
+    }
+    result = mininez_vm_execute(ctx, g->inst);
+    if (result == MININEZ_STACK_OVERFLOW) {
+      fprintf(stderr, "%s: stack overflow!!\n", file->path);
+      w->failed++;
+    } else if (!result) {
+      fprintf(stderr, "%s: parse error!!\n", file->path);
+      w->failed++;
+    } else if (ctx->pos != (long)ctx->input_size) {
+      fprintf(stderr, "%s: unconsumed!! pos=%ld size=%zu\n", file->path, ctx->pos, ctx->input_size);
+      w->failed++;
+    } else {
+      w->matched++;
+    }
+    w->bytes += ctx->input_size;
+    mininez_UnloadInput(ctx);
+  }
+  mininez_DisposeContext(ctx);
+  return NULL;
+}
+
+int mininez_ParseBatch(Grammar g, const char *list_file, int threads,
+    size_t memo_window, size_t stream_window) {
+  Batch batch;
+  BatchFile *files;
+  size_t size, missing, i;
+  size_t bytes = 0, matched = 0, failed, stolen = 0;
+  uint64_t start, end;
+  double mb_per_sec;
+  unsigned n;
+
+  files = readFileList(list_file, &size, &missing);
+  qsort(files, size, sizeof(BatchFile), compareFileSize);
+  if (threads <= 0) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? (int)cores : 1;
+  }
+  if ((size_t)threads > size) {
+    threads = size > 0 ? (int)size : 1;
+  }
+
+  batch.grammar = g;
+  batch.worker_size = (unsigned)threads;
+  batch.memo_window = memo_window;
+  batch.stream_window = stream_window;
+  batch.workers = (BatchWorker *)calloc(batch.worker_size, sizeof(BatchWorker));
+  for (n = 0; n < batch.worker_size; n++) {
+    BatchWorker *w = &batch.workers[n];
+    w->batch = &batch;
+    w->id = n;
+    pthread_mutex_init(&w->queue.lock, NULL);
+    w->queue.files = (BatchFile **)malloc(sizeof(BatchFile *) * (size / batch.worker_size + 1));
+  }
+  for (i = 0; i < size; i++) {
+    BatchQueue *q = &batch.workers[i % batch.worker_size].queue;
+    q->files[q->tail++] = &files[i];
+  }
+
+  start = batchTimer();
+  for (n = 0; n < batch.worker_size; n++) {
+    BatchWorker *w = &batch.workers[n];
+    if (pthread_create(&w->thread, NULL, batchWorker, w) != 0) {
+      w->error = "pthread_create error: cannot start parser thread";
+      continue;
+    }
+    w->started = 1;
+  }
+  for (n = 0; n < batch.worker_size; n++) {
+    BatchWorker *w = &batch.workers[n];
+    if (w->started) {
+      pthread_join(w->thread, NULL);
+    }
+    if (w->error != NULL) {
+      fprintf(stderr, "batch: worker %u: %s\n", n, w->error);
+    }
+    bytes += w->bytes;
+    matched += w->matched;
+    stolen += w->stolen;
+  }
+  end = batchTimer();
+
+  failed = size + missing - matched;
+  mb_per_sec = end > start ? (double)bytes / (1024.0 * 1024.0) / ((double)(end - start) / 1000.0) : 0.0;
+  fprintf(stderr, "batch: files=%zu bytes=%zu matched=%zu failed=%zu threads=%u stolen=%zu\n",
+      size + missing, bytes, matched, failed, batch.worker_size, stolen);
+  fprintf(stderr, "ErapsedTime: %llu msec (%.2f MB/s)\n", (unsigned long long)(end - start), mb_per_sec);
+
+  for (n = 0; n < batch.worker_size; n++) {
+    pthread_mutex_destroy(&batch.workers[n].queue.lock);
+    free(batch.workers[n].queue.files);
+  }
+  free(batch.workers);
+  for (i = 0; i < size; i++) {
+    free(files[i].path);
+  }
+  free(files);
+  return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
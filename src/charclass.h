@@ -0,0 +1,199 @@
+/****************************************************************************
+ * Copyright (c) 2015, Masahiro Ide <imasahiro9 at gmail.com>
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ ***************************************************************************/
+
+#ifndef CHARCLASS_H
+#define CHARCLASS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "bitset.h"
+
+/*
+** Vectorized span of a character class: the number of leading bytes of
+** a string that are in a set. A set is precompiled into two 16-byte
+** nibble tables. Bit h of low[l] is set if the byte (h << 4 | l) is in
+** the set (h < 8), and high[l] holds the same for h >= 8. A pshufb of
+** each table by the input gives the row of every byte, and a third
+** pshufb by the high nibbles selects the bit to test, so one block of
+** 16 (SSSE3) or 32 (AVX2) bytes costs a handful of instructions,
+** whatever the shape of the set.
+**
+** The kernels stop at the first byte that is not in the set, so they
+** require that the string ends with a byte that is not in it. NUL is
+** used as the sentinel, and the string must stay readable for 31 bytes
+** past it (see MININEZ_INPUT_PADDING). For a set that contains NUL,
+** charclass_span falls back to the scalar loop.
+*/
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CHARCLASS_USE_SIMD 1
+#include <x86intrin.h>
+#endif
+
+enum charclass_kernel {
+    CHARCLASS_SCALAR,
+    CHARCLASS_SSSE3,
+    CHARCLASS_AVX2
+};
+
+typedef struct charclass_t {
+    uint8_t low[16];
+    uint8_t high[16];
+} charclass_t;
+
+static inline void charclass_init(charclass_t *cc, bitset_t *set)
+{
+    unsigned c;
+    memset(cc, 0, sizeof(*cc));
+    for (c = 0; c < 256; c++) {
+        if (bitset_get(set, (unsigned char)c)) {
+            if (c < 128) {
+                cc->low[c & 0xf] |= 1 << (c >> 4);
+            }
+            else {
+                cc->high[c & 0xf] |= 1 << ((c >> 4) - 8);
+            }
+        }
+    }
+}
+
+/* the widest kernel the running CPU supports */
+static inline int charclass_select(void)
+{
+#ifdef CHARCLASS_USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return CHARCLASS_AVX2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return CHARCLASS_SSSE3;
+    }
+#endif
+    return CHARCLASS_SCALAR;
+}
+
+static inline size_t charclass_span_scalar(const bitset_t *set, const char *s)
+{
+    size_t n = 0;
+    while (bitset_get((bitset_t *)set, s[n])) {
+        n++;
+    }
+    return n;
+}
+
+#ifdef CHARCLASS_USE_SIMD
+__attribute__((target("ssse3")))
+static inline size_t charclass_span_ssse3(const charclass_t *cc, const char *s)
+{
+    const __m128i low = _mm_loadu_si128((const __m128i *)cc->low);
+    const __m128i high = _mm_loadu_si128((const __m128i *)cc->high);
+    const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                       1, 2, 4, 8, 16, 32, 64, -128);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i flip = _mm_set1_epi8(-128);
+    size_t n = 0;
+    while (1) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + n));
+        /* pshufb yields 0 for indices with the top bit set */
+        __m128i row = _mm_or_si128(_mm_shuffle_epi8(low, v),
+                                   _mm_shuffle_epi8(high, _mm_xor_si128(v, flip)));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+        __m128i miss = _mm_cmpeq_epi8(_mm_and_si128(row, bit), _mm_setzero_si128());
+        unsigned mask = (unsigned)_mm_movemask_epi8(miss);
+        if (mask != 0) {
+            return n + __builtin_ctz(mask);
+        }
+        n += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline size_t charclass_span_avx2(const charclass_t *cc, const char *s)
+{
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cc->low));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)cc->high));
+    const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128,
+                                          1, 2, 4, 8, 16, 32, 64, -128);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i flip = _mm256_set1_epi8(-128);
+    size_t n = 0;
+    while (1) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + n));
+        __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(low, v),
+                                      _mm256_shuffle_epi8(high, _mm256_xor_si256(v, flip)));
+        __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i miss = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), _mm256_setzero_si256());
+        unsigned mask = (unsigned)_mm256_movemask_epi8(miss);
+        if (mask != 0) {
+            return n + __builtin_ctz(mask);
+        }
+        n += 32;
+    }
+}
+#endif
+
+/*
+** The vector span at s, for a kernel other than CHARCLASS_SCALAR and a
+** set that does not contain NUL.
+*/
+static inline size_t charclass_scan(int kernel, const charclass_t *cc, const char *s)
+{
+#ifdef CHARCLASS_USE_SIMD
+    if (kernel == CHARCLASS_AVX2) {
+        return charclass_span_avx2(cc, s);
+    }
+    return charclass_span_ssse3(cc, s);
+#else
+    (void)kernel;
+    (void)cc;
+    (void)s;
+    return 0;
+#endif
+}
+
+/*
+** The span of set (precompiled into cc) at s. The first bytes are tested
+** in scalar code: most runs of white space are short, and a vector call
+** costs about as much as a scalar loop over CHARCLASS_SCALAR_PREFIX bytes.
+*/
+#define CHARCLASS_SCALAR_PREFIX 8
+
+static inline size_t charclass_span(int kernel, const charclass_t *cc, const bitset_t *set, const char *s)
+{
+    size_t n;
+    for (n = 0; n < CHARCLASS_SCALAR_PREFIX; n++) {
+        if (!bitset_get((bitset_t *)set, s[n])) {
+            return n;
+        }
+    }
+    if (kernel != CHARCLASS_SCALAR && !bitset_get((bitset_t *)set, 0)) {
+        return n + charclass_scan(kernel, cc, s + n);
+    }
+    return n + charclass_span_scalar(set, s + n);
+}
+
+#endif /* end of include guard */
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define VM_MALLOC(N) malloc(N)
+#define VM_FREE(P) free(P)
+
+#include "vm.h"
+#include "pstring.h"
+
+/*
+** Grammar images.
+**
+** An image is a loaded grammar as it sits in memory after the loader and
+** the optimizer: the instructions, the set pool with its byte classes and
+** scan tables, the Ifirst jump tables, the entry points and the three
+** string pools as
+** pstrings. Every reference inside it is an index or an offset from the
+** start of the image, so the file is mapped read-only and used in place;
+** loading it allocates only the three pointer arrays of the string pools,
+** and processes mapping the same image share its pages.
+**
+** The layout is that of the host (word size, byte order, bitset_t), which
+** the header records; an image is rebuilt from the bytecode, not moved
+** between machines. The header and the bounds of every section and string
+** are checked when it is mapped, the instructions are not: an image is
+** trusted like the shared libraries next to it.
+*/
+
+#define MININEZ_IMAGE_MAGIC   "MNZIMG\r\n"
+#define MININEZ_IMAGE_VERSION 2
+#define MININEZ_IMAGE_ORDER   0x01020304U
+/* sections start on a cache line, which also suits the vector loads */
+#define MININEZ_IMAGE_ALIGN   64
+
+enum MiniNezImageSection {
+  IMAGE_INST,
+  IMAGE_SETS,
+  IMAGE_BYTE_CLASS,
+  IMAGE_CLASS_SETS,
+  IMAGE_CLASSES,
+  IMAGE_JUMP_TABLES,
+  IMAGE_ENTRIES,
+  IMAGE_NTERMS,
+  IMAGE_STRS,
+  IMAGE_TAGS,
+  IMAGE_STRINGS,
+  IMAGE_SECTION_SIZE
+};
+
+typedef struct MiniNezImageHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  /* the host layout the image was written with */
+  uint32_t pointer_size;
+  uint32_t inst_width;
+  uint32_t bitset_width;
+  uint32_t charclass_width;
+  uint32_t inst_size;
+  uint32_t nterm_size;
+  uint32_t set_size;
+  uint32_t class_shift;
+  uint32_t class_size;
+  uint32_t str_size;
+  uint32_t tag_size;
+  uint32_t jump_table_size;
+  uint32_t entry_size;
+  uint64_t offset[IMAGE_SECTION_SIZE];
+  uint64_t length[IMAGE_SECTION_SIZE];
+  uint64_t image_size;
+} MiniNezImageHeader;
+
+static size_t alignImage(size_t n) {
+  return (n + MININEZ_IMAGE_ALIGN - 1) & ~(size_t)(MININEZ_IMAGE_ALIGN - 1);
+}
+
+static size_t classRowSize(const struct Grammar *g) {
+  return (size_t)1 << g->class_shift;
+}
+
+/* a pool string in the image: the pstring_t header, the bytes, the padding */
+static size_t poolStringSize(const char *s) {
+  size_t n = sizeof(pstring_t) + pstring_length(s) + PSTRING_PADDING;
+  return (n + sizeof(unsigned) - 1) & ~(sizeof(unsigned) - 1);
+}
+
+static size_t poolSize(const char **pool, unsigned size) {
+  size_t n = 0;
+  unsigned i;
+  for (i = 0; i < size; i++) {
+    n += poolStringSize(pool[i]);
+  }
+  return n;
+}
+
+/* copy a pool into the string section; offsets[i] addresses the bytes of string i */
+static size_t writePool(char *image, size_t cur, uint32_t *offsets,
+    const char **pool, unsigned size) {
+  unsigned i;
+  for (i = 0; i < size; i++) {
+    unsigned len = pstring_length(pool[i]);
+    pstring_t *str = (pstring_t *)(image + cur);
+    str->len = len;
+    memcpy(str->str, pool[i], len);
+    offsets[i] = (uint32_t)(cur + OFFSET_OF(pstring_t, str));
+    cur += poolStringSize(pool[i]);
+  }
+  return cur;
+}
+
+int mininez_SaveGrammarImage(Grammar g, const char *path, const char **error) {
+  MiniNezImageHeader header;
+  size_t cur, strings;
+  char *image;
+  char *tmp;
+  FILE *fp;
+  int i, ok;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MININEZ_IMAGE_MAGIC, sizeof(header.magic));
+  header.version = MININEZ_IMAGE_VERSION;
+  header.byte_order = MININEZ_IMAGE_ORDER;
+  header.pointer_size = sizeof(void *);
+  header.inst_width = sizeof(MiniNezInstruction);
+  header.bitset_width = sizeof(bitset_t);
+  header.charclass_width = sizeof(charclass_t);
+  header.inst_size = g->inst_size;
+  header.nterm_size = g->nterm_size;
+  header.set_size = g->set_size;
+  header.class_shift = g->class_shift;
+  header.class_size = g->class_size;
+  header.str_size = g->str_size;
+  header.tag_size = g->tag_size;
+  header.jump_table_size = g->jump_table_size;
+  header.entry_size = g->entry_size;
+  header.length[IMAGE_INST] = sizeof(MiniNezInstruction) * g->inst_size;
+  header.length[IMAGE_SETS] = sizeof(bitset_t) * g->set_size;
+  header.length[IMAGE_BYTE_CLASS] = 256;
+  header.length[IMAGE_CLASS_SETS] = classRowSize(g) * g->set_size + 1;
+  header.length[IMAGE_CLASSES] = g->classes != NULL ? sizeof(charclass_t) * g->set_size : 0;
+  header.length[IMAGE_JUMP_TABLES] = sizeof(MiniNezJumpTable) * g->jump_table_size;
+  header.length[IMAGE_ENTRIES] = sizeof(MiniNezEntry) * g->entry_size;
+  header.length[IMAGE_NTERMS] = sizeof(uint32_t) * g->nterm_size;
+  header.length[IMAGE_STRS] = sizeof(uint32_t) * g->str_size;
+  header.length[IMAGE_TAGS] = sizeof(uint32_t) * g->tag_size;
+  header.length[IMAGE_STRINGS] = poolSize(g->nterms, g->nterm_size)
+      + poolSize(g->strs, g->str_size) + poolSize(g->tags, g->tag_size);
+  cur = alignImage(sizeof(header));
+  for (i = 0; i < IMAGE_SECTION_SIZE; i++) {
+    header.offset[i] = cur;
+    cur = alignImage(cur + header.length[i]);
+  }
+  header.image_size = cur;
+  if (cur > UINT32_MAX) {
+    *error = "image error: the grammar is too large for an image";
+    return 0;
+  }
+
+  image = (char *)calloc(1, cur);
+  if (image == NULL) {
+    *error = "image error: out of memory";
+    return 0;
+  }
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + header.offset[IMAGE_INST], g->inst, header.length[IMAGE_INST]);
+  if (g->set_size > 0) {
+    memcpy(image + header.offset[IMAGE_SETS], g->sets, header.length[IMAGE_SETS]);
+  }
+  memcpy(image + header.offset[IMAGE_BYTE_CLASS], g->byte_class, 256);
+  memcpy(image + header.offset[IMAGE_CLASS_SETS], g->class_sets, header.length[IMAGE_CLASS_SETS]);
+  if (g->classes != NULL) {
+    memcpy(image + header.offset[IMAGE_CLASSES], g->classes, header.length[IMAGE_CLASSES]);
+  }
+  if (g->jump_table_size > 0) {
+    memcpy(image + header.offset[IMAGE_JUMP_TABLES], g->jump_tables,
+        header.length[IMAGE_JUMP_TABLES]);
+  }
+  memcpy(image + header.offset[IMAGE_ENTRIES], g->entries, header.length[IMAGE_ENTRIES]);
+  strings = header.offset[IMAGE_STRINGS];
+  strings = writePool(image, strings, (uint32_t *)(image + header.offset[IMAGE_NTERMS]),
+      g->nterms, g->nterm_size);
+  strings = writePool(image, strings, (uint32_t *)(image + header.offset[IMAGE_STRS]),
+      g->strs, g->str_size);
+  writePool(image, strings, (uint32_t *)(image + header.offset[IMAGE_TAGS]),
+      g->tags, g->tag_size);
+
+  /* write beside the target and rename, so processes mapping it never see a partial image */
+  tmp = (char *)malloc(strlen(path) + 8);
+  sprintf(tmp, "%s.tmp", path);
+  fp = fopen(tmp, "wb");
+  ok = fp != NULL && fwrite(image, 1, cur, fp) == cur;
+  if (fp != NULL && fclose(fp) != 0) {
+    ok = 0;
+  }
+  if (ok && rename(tmp, path) != 0) {
+    ok = 0;
+  }
+  if (!ok) {
+    if (fp != NULL) {
+      unlink(tmp);
+    }
+    *error = "image error: cannot write the image file";
+  }
+  free(tmp);
+  free(image);
+  return ok;
+}
+
+int mininez_IsGrammarImage(const void *code, size_t length) {
+  return length >= sizeof(MININEZ_IMAGE_MAGIC) - 1
+      && memcmp(code, MININEZ_IMAGE_MAGIC, sizeof(MININEZ_IMAGE_MAGIC) - 1) == 0;
+}
+
+static const char **mapPool(char *image, size_t image_size, const uint32_t *offsets,
+    unsigned size, size_t strings) {
+  const char **pool;
+  unsigned i;
+  if (size == 0) {
+    return NULL;
+  }
+  pool = (const char **)malloc(sizeof(const char *) * size);
+  for (i = 0; i < size; i++) {
+    size_t off = offsets[i];
+    if (off < strings + OFFSET_OF(pstring_t, str) || off > image_size
+        || (off - OFFSET_OF(pstring_t, str)) % sizeof(unsigned) != 0
+        || image_size - off < (size_t)pstring_length(image + off) + PSTRING_PADDING) {
+      free(pool);
+      return NULL;
+    }
+    pool[i] = image + off;
+  }
+  return pool;
+}
+
+/*
+** An image mapped by loadFile. The grammar keeps the mapping and
+** mininez_DisposeGrammar unmaps it; on failure it is left to the caller.
+*/
+Grammar mininez_LoadGrammarImage(char *image, size_t image_size, int flags,
+    const char **error) {
+  MiniNezImageHeader header;
+  struct Grammar *g;
+  int i;
+
+  if (image_size < sizeof(header)) {
+    *error = "image error: the file ends in the middle of the header";
+    return NULL;
+  }
+  memcpy(&header, image, sizeof(header));
+  if (header.version != MININEZ_IMAGE_VERSION || header.byte_order != MININEZ_IMAGE_ORDER
+      || header.pointer_size != sizeof(void *)
+      || header.inst_width != sizeof(MiniNezInstruction)
+      || header.bitset_width != sizeof(bitset_t)
+      || header.charclass_width != sizeof(charclass_t)) {
+    *error = "image error: the image was written by another build; rebuild it from the bytecode";
+    return NULL;
+  }
+  if (header.image_size != image_size) {
+    *error = "image error: the file ends in the middle of the image";
+    return NULL;
+  }
+  if (header.length[IMAGE_INST] != sizeof(MiniNezInstruction) * (uint64_t)header.inst_size
+      || header.inst_size <= MININEZ_INST_OFFSET
+      || header.length[IMAGE_SETS] != sizeof(bitset_t) * (uint64_t)header.set_size
+      || header.length[IMAGE_BYTE_CLASS] != 256
+      || header.class_shift > 5
+      || header.length[IMAGE_CLASS_SETS]
+          != ((uint64_t)1 << header.class_shift) * header.set_size + 1
+      || (header.length[IMAGE_CLASSES] != 0
+          && header.length[IMAGE_CLASSES] != sizeof(charclass_t) * (uint64_t)header.set_size)
+      || header.length[IMAGE_JUMP_TABLES]
+          != sizeof(MiniNezJumpTable) * (uint64_t)header.jump_table_size
+      || header.entry_size == 0
+      || header.length[IMAGE_ENTRIES] != sizeof(MiniNezEntry) * (uint64_t)header.entry_size
+      || header.length[IMAGE_NTERMS] != sizeof(uint32_t) * (uint64_t)header.nterm_size
+      || header.length[IMAGE_STRS] != sizeof(uint32_t) * (uint64_t)header.str_size
+      || header.length[IMAGE_TAGS] != sizeof(uint32_t) * (uint64_t)header.tag_size) {
+    *error = "image error: malformed section table";
+    return NULL;
+  }
+  for (i = 0; i < IMAGE_SECTION_SIZE; i++) {
+    if (header.offset[i] % MININEZ_IMAGE_ALIGN != 0 || header.offset[i] > image_size
+        || image_size - header.offset[i] < header.length[i]) {
+      *error = "image error: malformed section table";
+      return NULL;
+    }
+  }
+
+  g = (struct Grammar *)calloc(1, sizeof(struct Grammar));
+  g->image = image;
+  g->image_size = image_size;
+  g->verbose = (flags & MININEZ_LOAD_VERBOSE) != 0;
+  g->inst = (MiniNezInstruction *)(image + header.offset[IMAGE_INST]);
+  g->inst_size = header.inst_size;
+  g->set_size = header.set_size;
+  g->sets = header.set_size > 0 ? (bitset_t *)(image + header.offset[IMAGE_SETS]) : NULL;
+  g->byte_class = (uint8_t *)(image + header.offset[IMAGE_BYTE_CLASS]);
+  g->class_sets = (uint8_t *)(image + header.offset[IMAGE_CLASS_SETS]);
+  g->class_shift = header.class_shift;
+  g->class_size = header.class_size;
+  if (header.length[IMAGE_CLASSES] > 0) {
+    g->classes = (charclass_t *)(image + header.offset[IMAGE_CLASSES]);
+  }
+  g->charclass_kernel = charclass_select();
+  g->jump_table_size = header.jump_table_size;
+  if (header.jump_table_size > 0) {
+    g->jump_tables = (MiniNezJumpTable *)(image + header.offset[IMAGE_JUMP_TABLES]);
+  }
+  g->entries = (MiniNezEntry *)(image + header.offset[IMAGE_ENTRIES]);
+  g->entry_size = header.entry_size;
+  for (i = 0; i < (int)g->entry_size; i++) {
+    if (g->entries[i].addr < MININEZ_INST_OFFSET || g->entries[i].addr >= g->inst_size) {
+      *error = "image error: malformed section table";
+      VM_FREE(g);
+      return NULL;
+    }
+  }
+  g->nterm_size = header.nterm_size;
+  g->str_size = header.str_size;
+  g->tag_size = header.tag_size;
+  g->nterms = mapPool(image, image_size, (uint32_t *)(image + header.offset[IMAGE_NTERMS]),
+      header.nterm_size, header.offset[IMAGE_STRINGS]);
+  g->strs = mapPool(image, image_size, (uint32_t *)(image + header.offset[IMAGE_STRS]),
+      header.str_size, header.offset[IMAGE_STRINGS]);
+  g->tags = mapPool(image, image_size, (uint32_t *)(image + header.offset[IMAGE_TAGS]),
+      header.tag_size, header.offset[IMAGE_STRINGS]);
+  if ((g->nterm_size > 0 && g->nterms == NULL) || (g->str_size > 0 && g->strs == NULL)
+      || (g->tag_size > 0 && g->tags == NULL)) {
+    *error = "image error: a pool string lies outside the image";
+    VM_FREE(g->nterms);
+    VM_FREE(g->strs);
+    VM_FREE(g->tags);
+    VM_FREE(g);
+    return NULL;
+  }
+  g->memory_size = sizeof(const char *) * (g->nterm_size + g->str_size + g->tag_size);
+  if (g->verbose) {
+    fprintf(stderr, "image: %zu [byte] mapped, %zu [byte] allocated\n",
+        image_size, g->memory_size);
+  }
+  if (flags & MININEZ_LOAD_DIRECT) {
+    mininez_ThreadGrammar(g);
+  }
+  if (flags & MININEZ_LOAD_JIT) {
+    mininez_CompileGrammar(g);
+  }
+  return g;
+}
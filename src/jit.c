@@ -0,0 +1,588 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "vm.h"
+
+/*
+** x86-64 translation of the loaded instructions. Each instruction becomes
+** a short native sequence; jumps, calls and alternatives become direct
+** branches, so only Iret, Ifirst and failure take an indirect branch.
+** Irset calls the vector scan of charclass.h after its first bytes,
+** and Iscanbyte and Iscanstr call the scan kernels of pstring.h. The
+** generated function keeps the parser state in callee-saved registers:
+**   rbx  input (ctx->inputs)       r13  stack pointer
+**   r12  pos                       r14  failPoint
+**   r15  ctx
+** The backtrack stack has the interpreter's layout (see push_alt), but
+** the frames hold native code addresses instead of instructions. A push
+** into the guard page unwinds through the same signal handler.
+**
+** The translation covers the stripped loop only: memo tables, tree
+** construction, streaming and tracing stay with the interpreter, and
+** mininez_vm_execute only enters the native code when none is enabled.
+*/
+
+#if defined(__x86_64__) && USE_STACK_ENTRY == 0
+
+typedef long (*JitFunction)(Context ctx, const char *inputs, long *stack_pointer,
+    const void *entry);
+
+typedef struct JitPatch {
+  size_t offset;   /* of a rel32 operand */
+  unsigned target; /* instruction address */
+} JitPatch;
+
+typedef struct JitBuffer {
+  unsigned char *code;
+  size_t size;
+  size_t capacity;
+  JitPatch *patches;
+  size_t patch_size;
+  size_t patch_capacity;
+  size_t fail;     /* offset of the failure stub */
+  size_t exit;     /* offset of the epilogue */
+  size_t *tables;  /* rel32 of the lea that loads each Ifirst table */
+} JitBuffer;
+
+#define REG_RAX 0
+
+static void emit8(JitBuffer *buf, unsigned char b) {
+  if (buf->size == buf->capacity) {
+    buf->capacity *= 2;
+    buf->code = (unsigned char *)realloc(buf->code, buf->capacity);
+  }
+  buf->code[buf->size++] = b;
+}
+
+static void emitBytes(JitBuffer *buf, const char *bytes, size_t len) {
+  size_t i;
+  for (i = 0; i < len; i++) {
+    emit8(buf, (unsigned char)bytes[i]);
+  }
+}
+
+static void emit32(JitBuffer *buf, uint32_t v) {
+  emit8(buf, v & 0xff);
+  emit8(buf, (v >> 8) & 0xff);
+  emit8(buf, (v >> 16) & 0xff);
+  emit8(buf, (v >> 24) & 0xff);
+}
+
+static void emit64(JitBuffer *buf, uint64_t v) {
+  emit32(buf, (uint32_t)v);
+  emit32(buf, (uint32_t)(v >> 32));
+}
+
+static void patchRel32(JitBuffer *buf, size_t offset, size_t target) {
+  int32_t rel = (int32_t)((long)target - (long)(offset + 4));
+  memcpy(buf->code + offset, &rel, 4);
+}
+
+/* rel32 operand to a native offset that is already known */
+static void emitRel32To(JitBuffer *buf, size_t target) {
+  size_t offset = buf->size;
+  emit32(buf, 0);
+  patchRel32(buf, offset, target);
+}
+
+/* rel32 operand to the code of an instruction, patched after emission */
+static void emitRel32ToInst(JitBuffer *buf, unsigned target) {
+  if (buf->patch_size == buf->patch_capacity) {
+    buf->patch_capacity *= 2;
+    buf->patches = (JitPatch *)realloc(buf->patches, sizeof(JitPatch) * buf->patch_capacity);
+  }
+  buf->patches[buf->patch_size].offset = buf->size;
+  buf->patches[buf->patch_size].target = target;
+  buf->patch_size++;
+  emit32(buf, 0);
+}
+
+/* rel32 operand to a label later in the same instruction */
+static size_t emitForwardRel32(JitBuffer *buf) {
+  size_t offset = buf->size;
+  emit32(buf, 0);
+  return offset;
+}
+
+static void bindForward(JitBuffer *buf, size_t offset) {
+  patchRel32(buf, offset, buf->size);
+}
+
+/* ModRM/SIB for [rbx + r12 + disp]; the prefix carries REX.X */
+static void emitInputOperand(JitBuffer *buf, unsigned reg, unsigned disp) {
+  if (disp == 0) {
+    emit8(buf, 0x04 | (reg << 3));
+    emit8(buf, 0x23);
+  }
+  else if (disp < 128) {
+    emit8(buf, 0x44 | (reg << 3));
+    emit8(buf, 0x23);
+    emit8(buf, (unsigned char)disp);
+  }
+  else {
+    emit8(buf, 0x84 | (reg << 3));
+    emit8(buf, 0x23);
+    emit32(buf, disp);
+  }
+}
+
+static void emitJumpFail(JitBuffer *buf) {
+  emit8(buf, 0xe9);
+  emitRel32To(buf, buf->fail);
+}
+
+/* jcc rel32 to the failure stub; cc is the low nibble of 0f 8x */
+static void emitJccFail(JitBuffer *buf, unsigned cc) {
+  emit8(buf, 0x0f);
+  emit8(buf, 0x80 | cc);
+  emitRel32To(buf, buf->fail);
+}
+
+static size_t emitJccForward(JitBuffer *buf, unsigned cc) {
+  emit8(buf, 0x0f);
+  emit8(buf, 0x80 | cc);
+  return emitForwardRel32(buf);
+}
+
+#define CC_NC 0x3
+#define CC_E  0x4
+#define CC_NE 0x5
+
+static void emitJumpInst(JitBuffer *buf, unsigned target) {
+  emit8(buf, 0xe9);
+  emitRel32ToInst(buf, target);
+}
+
+/* movzx eax, byte [rbx + r12] */
+static void emitLoadByte(JitBuffer *buf) {
+  emitBytes(buf, "\x42\x0f\xb6", 3);
+  emitInputOperand(buf, REG_RAX, 0);
+}
+
+/* cmp byte [rbx + r12 + disp], imm8 */
+static void emitCmpByte(JitBuffer *buf, unsigned disp, unsigned char imm) {
+  emitBytes(buf, "\x42\x80", 2);
+  emitInputOperand(buf, 7, disp);
+  emit8(buf, imm);
+}
+
+/* inc r12 / add r12, imm32 */
+static void emitAdvance(JitBuffer *buf, unsigned len) {
+  if (len == 1) {
+    emitBytes(buf, "\x49\xff\xc4", 3);
+  }
+  else if (len > 1) {
+    emitBytes(buf, "\x49\x81\xc4", 3);
+    emit32(buf, len);
+  }
+}
+
+/*
+** Compare the input at pos with str, widest chunks first. A mismatch
+** branches to the failure stub if mismatch is NULL; otherwise to a
+** forward label, and the offsets of those rel32 operands are stored in
+** mismatch and their count is returned.
+*/
+static unsigned emitStrCompare(JitBuffer *buf, const char *str, unsigned len, size_t *mismatch) {
+  unsigned off = 0, n = 0;
+  while (len - off > 0) {
+    unsigned chunk = len - off >= 8 ? 8 : len - off >= 4 ? 4 : len - off >= 2 ? 2 : 1;
+    uint64_t v = 0;
+    memcpy(&v, str + off, chunk);
+    switch (chunk) {
+    case 8:
+      emitBytes(buf, "\x48\xb8", 2);     /* mov rax, imm64 */
+      emit64(buf, v);
+      emitBytes(buf, "\x4a\x39", 2);     /* cmp [rbx + r12 + off], rax */
+      emitInputOperand(buf, REG_RAX, off);
+      break;
+    case 4:
+      emitBytes(buf, "\x42\x81", 2);     /* cmp dword [rbx + r12 + off], imm32 */
+      emitInputOperand(buf, 7, off);
+      emit32(buf, (uint32_t)v);
+      break;
+    case 2:
+      emitBytes(buf, "\x66\x42\x81", 3); /* cmp word [rbx + r12 + off], imm16 */
+      emitInputOperand(buf, 7, off);
+      emit8(buf, v & 0xff);
+      emit8(buf, (v >> 8) & 0xff);
+      break;
+    default:
+      emitCmpByte(buf, off, (unsigned char)v);
+      break;
+    }
+    if (mismatch == NULL) {
+      emitJccFail(buf, CC_NE);
+    }
+    else {
+      mismatch[n++] = emitJccForward(buf, CC_NE);
+    }
+    off += chunk;
+  }
+  return n;
+}
+
+/* CF = the byte in eax is in set; clobbers rax, rcx and rdx */
+static void emitSetTest(JitBuffer *buf, bitset_t *set) {
+  emitBytes(buf, "\x89\xc1", 2);         /* mov ecx, eax */
+  emitBytes(buf, "\xc1\xe8\x06", 3);     /* shr eax, 6 */
+  emitBytes(buf, "\x48\xba", 2);         /* mov rdx, set */
+  emit64(buf, (uint64_t)(uintptr_t)set);
+  emitBytes(buf, "\x48\x8b\x04\xc2", 4); /* mov rax, [rdx + rax * 8] */
+  emitBytes(buf, "\x48\x0f\xa3\xc8", 4); /* bt rax, rcx */
+}
+
+/* push an alt frame [pos][target][failPoint] and make it the failPoint */
+static void emitPushAlt(JitBuffer *buf, unsigned target) {
+  emitBytes(buf, "\x4d\x89\x65\x00", 4); /* mov [r13], r12 */
+  emitBytes(buf, "\x48\x8d\x05", 3);     /* lea rax, [rip + target] */
+  emitRel32ToInst(buf, target);
+  emitBytes(buf, "\x49\x89\x45\x08", 4); /* mov [r13 + 8], rax */
+  emitBytes(buf, "\x4d\x89\x75\x10", 4); /* mov [r13 + 16], r14 */
+  emitBytes(buf, "\x4d\x89\xee", 3);     /* mov r14, r13 */
+  emitBytes(buf, "\x49\x83\xc5\x18", 4); /* add r13, 24 */
+}
+
+static void emitPushCall(JitBuffer *buf, unsigned target) {
+  emitBytes(buf, "\x48\x8d\x05", 3);     /* lea rax, [rip + target] */
+  emitRel32ToInst(buf, target);
+  emitBytes(buf, "\x49\x89\x45\x00", 4); /* mov [r13], rax */
+  emitBytes(buf, "\x49\x83\xc5\x08", 4); /* add r13, 8 */
+}
+
+/* Iskip with the loop head at target */
+static void emitSkip(JitBuffer *buf, unsigned target) {
+  emitBytes(buf, "\x4d\x3b\x26", 3);     /* cmp r12, [r14] */
+  emitJccFail(buf, CC_E);
+  emitBytes(buf, "\x4d\x89\x26", 3);     /* mov [r14], r12 */
+  emitJumpInst(buf, target);
+}
+
+static void emitPrologue(JitBuffer *buf) {
+  emitBytes(buf, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10); /* push rbx..r15 */
+  emitBytes(buf, "\x48\x83\xec\x08", 4); /* sub rsp, 8 (align calls) */
+  emitBytes(buf, "\x49\x89\xff", 3);     /* mov r15, rdi */
+  emitBytes(buf, "\x48\x89\xf3", 3);     /* mov rbx, rsi */
+  emitBytes(buf, "\x49\x89\xd5", 3);     /* mov r13, rdx */
+  emitBytes(buf, "\x45\x31\xe4", 3);     /* xor r12d, r12d */
+  emitBytes(buf, "\x4d\x89\xee", 3);     /* mov r14, r13 */
+  emitPushAlt(buf, MININEZ_INST_EXIT_FAIL);
+  emitPushCall(buf, MININEZ_INST_EXIT_SUCC);
+  emitBytes(buf, "\xff\xe1", 2);         /* jmp rcx (the entry point) */
+
+  buf->fail = buf->size;
+  emitBytes(buf, "\x4d\x89\xf5", 3);     /* mov r13, r14 */
+  emitBytes(buf, "\x4d\x8b\x26", 3);     /* mov r12, [r14] */
+  emitBytes(buf, "\x49\x8b\x46\x08", 4); /* mov rax, [r14 + 8] */
+  emitBytes(buf, "\x4d\x8b\x76\x10", 4); /* mov r14, [r14 + 16] */
+  emitBytes(buf, "\xff\xe0", 2);         /* jmp rax */
+
+  buf->exit = buf->size;
+  emitBytes(buf, "\x48\x83\xc4\x08", 4); /* add rsp, 8 */
+  emitBytes(buf, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5d\x5b\xc3", 11); /* pop r15..rbx; ret */
+}
+
+static int emitInstruction(JitBuffer *buf, Grammar g, MiniNezInstruction *inst, unsigned i) {
+  MiniNezInstruction *pc = &inst[i];
+  unsigned n, k;
+  switch (pc->op) {
+  case MININEZ_OP_Iexit:
+    emitBytes(buf, "\x4d\x89\xa7", 3);   /* mov [r15 + pos], r12 */
+    emit32(buf, offsetof(struct Context, pos));
+    emitBytes(buf, "\x4d\x89\xaf", 3);   /* mov [r15 + stack_pointer], r13 */
+    emit32(buf, offsetof(struct Context, stack_pointer));
+    emit8(buf, 0xb8);                    /* mov eax, arg */
+    emit32(buf, pc->arg);
+    emit8(buf, 0xe9);
+    emitRel32To(buf, buf->exit);
+    break;
+  case MININEZ_OP_Inop:
+  case MININEZ_OP_Ilabel:
+  case MININEZ_OP_Inew:
+  case MININEZ_OP_Itag:
+  case MININEZ_OP_Ilink:
+  case MININEZ_OP_Icapture:
+    break;
+  case MININEZ_OP_Ifail:
+    emitJumpFail(buf);
+    break;
+  case MININEZ_OP_Ialt:
+    emitPushAlt(buf, pc->arg);
+    break;
+  case MININEZ_OP_Isucc:
+    emitBytes(buf, "\x4d\x89\xf5", 3);   /* mov r13, r14 */
+    emitBytes(buf, "\x4d\x8b\x76\x10", 4); /* mov r14, [r14 + 16] */
+    break;
+  case MININEZ_OP_Ijump:
+    emitJumpInst(buf, pc->arg);
+    break;
+  case MININEZ_OP_Icall:
+    emitPushCall(buf, i + 2);
+    emitJumpInst(buf, pc->arg);
+    break;
+  case MININEZ_OP_Iret:
+    emitBytes(buf, "\x49\x83\xed\x08", 4); /* sub r13, 8 */
+    emitBytes(buf, "\x41\xff\x65\x00", 4); /* jmp [r13] */
+    break;
+  case MININEZ_OP_Ipos:
+    emitBytes(buf, "\x4d\x89\x65\x00", 4); /* mov [r13], r12 */
+    emitBytes(buf, "\x49\x83\xc5\x08", 4); /* add r13, 8 */
+    break;
+  case MININEZ_OP_Iback:
+    emitBytes(buf, "\x49\x83\xed\x08", 4); /* sub r13, 8 */
+    emitBytes(buf, "\x4d\x8b\x65\x00", 4); /* mov r12, [r13] */
+    break;
+  case MININEZ_OP_Iskip:
+    emitSkip(buf, pc->arg);
+    break;
+  case MININEZ_OP_Ibyte:
+    emitCmpByte(buf, 0, (unsigned char)pc->arg);
+    emitJccFail(buf, CC_NE);
+    emitAdvance(buf, 1);
+    break;
+  case MININEZ_OP_Iany:
+    emitCmpByte(buf, 0, 0);
+    emitJccFail(buf, CC_E);
+    emitAdvance(buf, 1);
+    break;
+  case MININEZ_OP_Inbyte:
+    emitCmpByte(buf, 0, (unsigned char)pc->arg);
+    emitJccFail(buf, CC_E);
+    break;
+  case MININEZ_OP_Istr: {
+    const char *str = g->strs[pc->arg];
+    emitStrCompare(buf, str, pstring_length(str), NULL);
+    emitAdvance(buf, pstring_length(str));
+    break;
+  }
+  case MININEZ_OP_Instr:
+  case MININEZ_OP_Iostr:
+  case MININEZ_OP_Instrany: {
+    const char *str = g->strs[pc->arg];
+    unsigned len = pstring_length(str);
+    size_t *mismatch = (size_t *)malloc(sizeof(size_t) * (len / 8 + 3));
+    n = emitStrCompare(buf, str, len, mismatch);
+    if (pc->op == MININEZ_OP_Iostr) {
+      emitAdvance(buf, len);
+    }
+    else {
+      emitJumpFail(buf);
+    }
+    for (k = 0; k < n; k++) {
+      bindForward(buf, mismatch[k]);
+    }
+    if (pc->op == MININEZ_OP_Instrany) {
+      emitCmpByte(buf, 0, 0);
+      emitJccFail(buf, CC_E);
+      emitAdvance(buf, 1);
+    }
+    free(mismatch);
+    break;
+  }
+  case MININEZ_OP_Iset:
+    emitLoadByte(buf);
+    emitSetTest(buf, &g->sets[pc->arg]);
+    emitJccFail(buf, CC_NC);
+    emitAdvance(buf, 1);
+    break;
+  case MININEZ_OP_Ioset: {
+    size_t out;
+    emitLoadByte(buf);
+    emitSetTest(buf, &g->sets[pc->arg]);
+    out = emitJccForward(buf, CC_NC);
+    emitAdvance(buf, 1);
+    bindForward(buf, out);
+    break;
+  }
+  case MININEZ_OP_Irset: {
+    size_t head = buf->size, out;
+    size_t (*span)(const charclass_t *, const char *) = NULL;
+    if (!bitset_get(&g->sets[pc->arg], 0)) {
+      span = g->charclass_kernel == CHARCLASS_AVX2 ? charclass_span_avx2
+          : g->charclass_kernel == CHARCLASS_SSSE3 ? charclass_span_ssse3 : NULL;
+    }
+    if (span != NULL) {
+      /* test the first bytes inline, call the vector scan for the rest */
+      size_t loop;
+      emit8(buf, 0xbf);                  /* mov edi, prefix */
+      emit32(buf, CHARCLASS_SCALAR_PREFIX);
+      loop = buf->size;
+      emitLoadByte(buf);
+      emitSetTest(buf, &g->sets[pc->arg]);
+      out = emitJccForward(buf, CC_NC);
+      emitAdvance(buf, 1);
+      emitBytes(buf, "\xff\xcf", 2);     /* dec edi */
+      emitBytes(buf, "\x0f\x85", 2);     /* jnz loop */
+      emitRel32To(buf, loop);
+      emitBytes(buf, "\x48\xbf", 2);     /* mov rdi, class */
+      emit64(buf, (uint64_t)(uintptr_t)&g->classes[pc->arg]);
+      emitBytes(buf, "\x4a\x8d\x34\x23", 4); /* lea rsi, [rbx + r12] */
+      emitBytes(buf, "\x48\xb8", 2);     /* mov rax, span */
+      emit64(buf, (uint64_t)(uintptr_t)span);
+      emitBytes(buf, "\xff\xd0", 2);     /* call rax */
+      emitBytes(buf, "\x49\x01\xc4", 3); /* add r12, rax */
+      bindForward(buf, out);
+      break;
+    }
+    emitLoadByte(buf);
+    emitSetTest(buf, &g->sets[pc->arg]);
+    out = emitJccForward(buf, CC_NC);
+    emitAdvance(buf, 1);
+    emit8(buf, 0xe9);
+    emitRel32To(buf, head);
+    bindForward(buf, out);
+    break;
+  }
+  case MININEZ_OP_Inbyteany:
+    emitLoadByte(buf);
+    emit8(buf, 0x3c);                    /* cmp al, arg */
+    emit8(buf, (unsigned char)pc->arg);
+    emitJccFail(buf, CC_E);
+    emitBytes(buf, "\x84\xc0", 2);       /* test al, al */
+    emitJccFail(buf, CC_E);
+    emitAdvance(buf, 1);
+    break;
+  case MININEZ_OP_Ianyskip:
+    emitCmpByte(buf, 0, 0);
+    emitJccFail(buf, CC_E);
+    emitAdvance(buf, 1);
+    emitSkip(buf, pc->arg);
+    break;
+  case MININEZ_OP_Ifirst:
+    /* the tables follow the code and hold targets relative to themselves */
+    emitLoadByte(buf);
+    emitBytes(buf, "\x48\x8d\x15", 3);   /* lea rdx, [rip + table] */
+    buf->tables[pc->arg] = emitForwardRel32(buf);
+    emitBytes(buf, "\x48\x63\x04\x82", 4); /* movsxd rax, [rdx + rax * 4] */
+    emitBytes(buf, "\x48\x01\xd0", 3);   /* add rax, rdx */
+    emitBytes(buf, "\xff\xe0", 2);       /* jmp rax */
+    break;
+  case MININEZ_OP_Iscanbyte:
+  case MININEZ_OP_Iscanstr:
+    emitBytes(buf, "\x4a\x8d\x3c\x23", 4); /* lea rdi, [rbx + r12] */
+    if (pc->op == MININEZ_OP_Iscanbyte) {
+      emit8(buf, 0xbe);                  /* mov esi, c */
+      emit32(buf, pc->arg);
+      emitBytes(buf, "\x48\xb8", 2);     /* mov rax, pstring_scan_byte */
+      emit64(buf, (uint64_t)(uintptr_t)(pstring_kernel == PSTRING_AVX2
+            ? pstring_scan_byte_avx2 : pstring_scan_byte_sse2));
+    }
+    else {
+      const char *str = g->strs[pc->arg];
+      if (pstring_length(str) == 0) {
+        break;
+      }
+      emitBytes(buf, "\x48\xbe", 2);     /* mov rsi, str */
+      emit64(buf, (uint64_t)(uintptr_t)str);
+      emit8(buf, 0xba);                  /* mov edx, len */
+      emit32(buf, pstring_length(str));
+      emitBytes(buf, "\x48\xb8", 2);     /* mov rax, pstring_scan_str */
+      emit64(buf, (uint64_t)(uintptr_t)(pstring_kernel == PSTRING_AVX2
+            ? pstring_scan_str_avx2 : pstring_scan_str_sse2));
+    }
+    emitBytes(buf, "\xff\xd0", 2);       /* call rax */
+    emitBytes(buf, "\x48\x29\xd8", 3);   /* sub rax, rbx */
+    emitBytes(buf, "\x49\x89\xc4", 3);   /* mov r12, rax */
+    break;
+  case MININEZ_OP_Imemofail:
+  case MININEZ_OP_Imemosucc:
+    /* only reachable through memoized calls */
+    emitBytes(buf, "\x0f\x0b", 2);       /* ud2 */
+    break;
+  default:
+    return 0;
+  }
+  return 1;
+}
+
+int mininez_CompileGrammar(Grammar g) {
+  JitBuffer buf;
+  size_t *native = (size_t *)malloc(sizeof(size_t) * (g->inst_size + 1));
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size, k;
+  unsigned i;
+  void *code;
+  int ok = 1;
+
+  buf.capacity = 4096;
+  buf.size = 0;
+  buf.code = (unsigned char *)malloc(buf.capacity);
+  buf.patch_capacity = 256;
+  buf.patch_size = 0;
+  buf.patches = (JitPatch *)malloc(sizeof(JitPatch) * buf.patch_capacity);
+
+  buf.tables = (size_t *)malloc(sizeof(size_t) * (g->jump_table_size + 1));
+
+  emitPrologue(&buf);
+  for (i = 0; i < g->inst_size && ok; i++) {
+    native[i] = buf.size;
+    ok = emitInstruction(&buf, g, g->inst, i);
+  }
+  native[g->inst_size] = buf.size;
+  code = MAP_FAILED;
+  if (ok) {
+    for (k = 0; k < buf.patch_size; k++) {
+      patchRel32(&buf, buf.patches[k].offset, native[buf.patches[k].target]);
+    }
+    while (buf.size % 4 != 0) {
+      emit8(&buf, 0xcc);
+    }
+    for (k = 0; k < g->jump_table_size; k++) {
+      size_t table = buf.size;
+      unsigned c;
+      bindForward(&buf, buf.tables[k]);
+      for (c = 0; c < 256; c++) {
+        emit32(&buf, (uint32_t)(native[g->jump_tables[k].target[c]] - table));
+      }
+    }
+    size = (buf.size + page - 1) & ~(page - 1);
+    code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code != MAP_FAILED) {
+      memcpy(code, buf.code, buf.size);
+      if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, size);
+        code = MAP_FAILED;
+      }
+    }
+    if (code != MAP_FAILED) {
+      g->jit_entries = (size_t *)malloc(sizeof(size_t) * g->entry_size);
+      for (k = 0; k < g->entry_size; k++) {
+        g->jit_entries[k] = native[g->entries[k].addr];
+      }
+      g->jit_code = code;
+      g->jit_size = size;
+      if (g->verbose) {
+        fprintf(stderr, "jit: %zu [byte] native code\n", buf.size);
+      }
+    }
+  }
+  free(native);
+  free(buf.tables);
+  free(buf.patches);
+  free(buf.code);
+  return code != MAP_FAILED;
+}
+
+long mininez_vm_execute_jit(Context ctx) {
+  Grammar g = ctx->grammar;
+  JitFunction fn = (JitFunction)g->jit_code;
+  return fn(ctx, ctx->inputs, ctx->stack_pointer,
+      (char *)g->jit_code + g->jit_entries[ctx->entry]);
+}
+
+#else
+
+int mininez_CompileGrammar(Grammar g) {
+  (void)g;
+  return 0;
+}
+
+long mininez_vm_execute_jit(Context ctx) {
+  (void)ctx;
+  return 0;
+}
+
+#endif
@@ -1,11 +1,16 @@
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #ifndef CHAR_BIT
 #define CHAR_BIT 8
 #endif
 
-size_t malloc_size = 0;
-#define VM_MALLOC(N) malloc(N); malloc_size += N;
+#define VM_MALLOC(N) malloc(N)
+#define VM_FREE(P) free(P)
 
 #include "vm.h"
 #include "pstring.h"
@@ -16,39 +21,119 @@ typedef struct ByteCodeInfo {
   char fileType[4];
   uint8_t version;
   uint16_t instSize;
+  uint16_t memoSize;
   uint16_t jmpTableSize;
   uint16_t nonTermPoolSize;
   uint16_t setPoolSize;
   uint16_t strPoolSize;
+  uint16_t tagPoolSize;
+  /* a read ran past code_length; reads return 0 from then on */
+  int truncated;
 } ByteCodeInfo;
 
 typedef struct ByteCodeLoader {
   char *input;
   ByteCodeInfo *info;
   MiniNezInstruction *head;
+  const char **nterms;
+  int trace;
+  int optimize;
+  unsigned inline_size;
+  const char *start_point;
+  const char *error;
 } ByteCodeLoader;
 
-char *loadFile(const char *filename, size_t *length) {
+/*
+** Inputs are mapped, not copied. The mapping is followed by at least one
+** page of zero bytes (MININEZ_INPUT_PADDING), which serves as the
+** end-of-input sentinel and keeps wide loads near the end in bounds.
+** Files that cannot be mapped (pipes, ttys) are read into an anonymous
+** mapping with the same layout, so unloadFile handles both. Both return
+** NULL with errno set when the file cannot be read.
+*/
+static size_t paddedSize(size_t len) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  return ((len + page - 1) & ~(page - 1)) + page;
+}
+
+static char *readStream(int fd, size_t *length) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t cap = page * 16;
   size_t len = 0;
-  FILE *fp = fopen(filename, "rb");
+  char *source = (char *)mmap(NULL, cap, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (source == MAP_FAILED) {
+    return NULL;
+  }
+  while (1) {
+    ssize_t n;
+    if (len + page >= cap) {
+      char *grown = (char *)mremap(source, cap, cap * 2, MREMAP_MAYMOVE);
+      if (grown == MAP_FAILED) {
+        munmap(source, cap);
+        return NULL;
+      }
+      source = grown;
+      cap *= 2;
+    }
+    n = read(fd, source + len, cap - len - page);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      munmap(source, cap);
+      return NULL;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += (size_t)n;
+  }
+  if (paddedSize(len) < cap) {
+    munmap(source + paddedSize(len), cap - paddedSize(len));
+  }
+  *length = len;
+  return source;
+}
+
+char *loadFile(const char *filename, size_t *length) {
+  struct stat st;
+  size_t len;
   char *source;
-  if (!fp) {
-    nez_PrintErrorInfo("fopen error: cannot open file");
+  int fd = filename != NULL ? open(filename, O_RDONLY) : -1;
+  if (fd < 0) {
+    return NULL;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    source = readStream(fd, length);
+    close(fd);
+    return source;
+  }
+  len = (size_t)st.st_size;
+  /* reserve the padded size, then map the file over its head */
+  source = (char *)mmap(NULL, paddedSize(len), PROT_READ,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (source == MAP_FAILED) {
+    close(fd);
     return NULL;
   }
-  fseek(fp, 0, SEEK_END);
-  len = (size_t)ftell(fp);
-  fseek(fp, 0, SEEK_SET);
-  source = (char *)malloc(len + 1);
-  if (len != fread(source, 1, len, fp)) {
-    nez_PrintErrorInfo("fread error: cannot read file collectly");
+  if (len > 0) {
+    if (mmap(source, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+      munmap(source, paddedSize(len));
+      close(fd);
+      return NULL;
+    }
+    madvise(source, len, MADV_SEQUENTIAL);
   }
-  source[len] = '\0';
-  fclose(fp);
+  close(fd);
   *length = len;
   return source;
 }
 
+void unloadFile(char *source, size_t length) {
+  munmap(source, paddedSize(length));
+}
+
 static char *peek(char* inputs, ByteCodeInfo *info)
 {
     return inputs + info->pos;
@@ -59,13 +144,24 @@ static void skip(ByteCodeInfo *info, size_t shift)
     info->pos += shift;
 }
 
+static int available(ByteCodeInfo *info, size_t shift) {
+  if ((size_t)info->pos + shift > info->code_length) {
+    info->truncated = 1;
+    return 0;
+  }
+  return 1;
+}
+
 static inline uint8_t read8(char* inputs, ByteCodeInfo *info) {
+  if (!available(info, 1)) {
+    return 0;
+  }
   return (uint8_t)inputs[info->pos++];
 }
 
 static uint16_t read16(char *inputs, ByteCodeInfo *info) {
-  uint16_t value = (uint8_t)inputs[info->pos++];
-  value = ((value) << 8) | ((uint8_t)inputs[info->pos++]);
+  uint16_t value = read8(inputs, info);
+  value = ((value) << 8) | read8(inputs, info);
   return value;
 }
 
@@ -95,20 +191,16 @@ static unsigned Loader_Read24(ByteCodeLoader *loader) {
   return read24(loader->input, loader->info);
 }
 
-static uint32_t Loader_Read32(ByteCodeLoader *loader) {
-  return read32(loader->input, loader->info);
-}
-
-#if MININEZ_DEBUG == 1
-
 static void dumpByteCodeInfo(ByteCodeInfo *info) {
   fprintf(stderr, "FileType: %s\n", info->fileType);
   fprintf(stderr, "Version: %c\n", info->version);
   fprintf(stderr, "InstSize: %u\n", info->instSize);
+  fprintf(stderr, "memoSize: %u\n", info->memoSize);
   fprintf(stderr, "jmpTableSize: %u\n", info->jmpTableSize);
   fprintf(stderr, "nonTermPoolSize: %u\n", info->nonTermPoolSize);
   fprintf(stderr, "setPoolSize: %u\n", info->setPoolSize);
   fprintf(stderr, "strPoolSize: %u\n", info->strPoolSize);
+  fprintf(stderr, "tagPoolSize: %u\n", info->tagPoolSize);
 }
 
 
@@ -180,8 +272,6 @@ static void dump_set(bitset_t *set, char *buf)
     *buf++ = '\0';
 }
 
-#endif
-
 static int loadOpCode(ByteCodeLoader* loader, int* has_jump) {
   uint8_t opcode = Loader_Read8(loader);
   *has_jump = opcode & 0x80;
@@ -199,6 +289,18 @@ static int loadOpCode(ByteCodeLoader* loader, int* has_jump) {
     case 25:
       opcode = MININEZ_OP_Irset;
       break;
+    case 33:
+      opcode = MININEZ_OP_Inew;
+      break;
+    case 34:
+      opcode = MININEZ_OP_Icapture;
+      break;
+    case 35:
+      opcode = MININEZ_OP_Itag;
+      break;
+    case 37:
+      opcode = MININEZ_OP_Ilink;
+      break;
     case 127:
       opcode = MININEZ_OP_Ilabel;
       break;
@@ -206,75 +308,71 @@ static int loadOpCode(ByteCodeLoader* loader, int* has_jump) {
   return opcode;
 }
 
-void loadMiniNezInstruction(MiniNezInstruction* ir, ByteCodeLoader *loader, Context ctx) {
+/*
+** The bytecode is decoded in two passes. The first pass reads each
+** instruction into a ByteCodeInst whose jump operands are still bytecode
+** indices. The second pass lays the instructions out (Icall takes an
+** extension word) and rewrites the jump operands to instruction addresses.
+*/
+typedef struct ByteCodeInst {
+  uint8_t op;
+  unsigned arg;
+  uint16_t nterm;
+} ByteCodeInst;
+
+static int hasJumpOperand(uint8_t op) {
+  switch (op) {
+    case MININEZ_OP_Ialt:
+    case MININEZ_OP_Ijump:
+    case MININEZ_OP_Icall:
+    case MININEZ_OP_Iskip:
+    case MININEZ_OP_Ianyskip:
+      return 1;
+  }
+  return 0;
+}
+
+static unsigned instructionWidth(uint8_t op) {
+  return op == MININEZ_OP_Icall ? 2 : 1;
+}
+
+static void decodeByteCode(ByteCodeInst* bc, ByteCodeLoader *loader) {
   unsigned i;
-  MiniNezInstruction* head = ir;
-  // exit fail case
-  ir->op = MININEZ_OP_Iexit;
-  ir->arg = 0;
-#if MININEZ_DEBUG == 1
-  fprintf(stderr, "[0]%s %d\n", get_opname(ir->op), ir->arg);
-#endif
-  ir++;
-  // exit success case
-  ir->op = MININEZ_OP_Iexit;
-  ir->arg = 1;
-#if MININEZ_DEBUG == 1
-  fprintf(stderr, "[1]%s %d\n", get_opname(ir->op), ir->arg);
-#endif
-  ir++;
-  int size = loader->info->instSize;
-  for(i = 0; i < loader->info->instSize; i++) {
-    assert(loader->info->pos < (int)loader->info->code_length);
+  for(i = 0; i < loader->info->instSize && !loader->info->truncated; i++) {
     int has_jump = 0;
+    ByteCodeInst* ir = &bc[i];
     uint8_t opcode = loadOpCode(loader, &has_jump);
-#if MININEZ_DEBUG == 1
-    fprintf(stderr, "[%u]%s", i, get_opname(opcode));
-#endif
+    ir->arg = 0;
+    ir->nterm = 0;
     switch (opcode) {
       case MININEZ_OP_Iexit:
         ir->arg = Loader_Read8(loader);
         break;
       case MININEZ_OP_Icall:
-        Loader_Read24(loader) + 2;
-        uint16_t nterm = Loader_Read16(loader);
-        ir->arg = Loader_Read24(loader) + 2;
+        Loader_Read24(loader);
+        ir->nterm = Loader_Read16(loader);
+        ir->arg = Loader_Read24(loader);
         has_jump = 0;
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " %u %d", nterm, ir->arg);
-#endif
         break;
       case MININEZ_OP_Ialt:
-        ir->arg = Loader_Read24(loader) + 2;
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " %d", ir->arg);
-#endif
+        ir->arg = Loader_Read24(loader);
         break;
       case MININEZ_OP_Ijump:
         if(has_jump) {
-          ir->arg = Loader_Read24(loader) + 2;
+          ir->arg = Loader_Read24(loader);
         } else {
-          ir->arg = ir - head + 1;
+          ir->arg = i + 1;
         }
         Loader_Read24(loader);
         has_jump = 0;
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " %d", ir->arg);
-#endif
         break;
       case MININEZ_OP_Iskip:
-        ir->arg = Loader_Read24(loader) + 2;
+        ir->arg = Loader_Read24(loader);
         has_jump = 0;
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " %d", ir->arg);
-#endif
         break;
       case MININEZ_OP_Ibyte:
       case MININEZ_OP_Inbyte:
         ir->arg = Loader_Read8(loader);
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " '%c'", ir->arg);
-#endif
         break;
       case MININEZ_OP_Istr:
       case MININEZ_OP_Instr:
@@ -283,41 +381,1290 @@ void loadMiniNezInstruction(MiniNezInstruction* ir, ByteCodeLoader *loader, Cont
       case MININEZ_OP_Ioset:
       case MININEZ_OP_Irset:
         ir->arg = Loader_Read16(loader);
-#if MININEZ_DEBUG == 1
-        fprintf(stderr, " %u", ir->arg);
-#endif
         break;
       case MININEZ_OP_Ilabel: {
         uint16_t label = Loader_Read16(loader);
         ir->arg = label;
         break;
       }
+      case MININEZ_OP_Itag:
+      case MININEZ_OP_Ilink:
+        /* tag id / link label (mininez doesn't use link labels) */
+        ir->arg = Loader_Read16(loader);
+        break;
     }
     if (has_jump) {
-      int jump = Loader_Read24(loader);
-      fprintf(stderr, "\n[%u]error!!", i);
+      Loader_Read24(loader);
+      if (loader->error == NULL) {
+        loader->error = "bytecode error: unexpected jump operand";
+      }
     }
-#if MININEZ_DEBUG == 1
-    fprintf(stderr, "\n");
-#endif
     ir->op = opcode;
+    if (loader->trace) {
+      fprintf(stderr, "[%u]%s %u", i, get_opname(opcode), ir->arg);
+      if (opcode == MININEZ_OP_Icall && ir->nterm < loader->info->nonTermPoolSize) {
+        fprintf(stderr, " (%s)", loader->nterms[ir->nterm]);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+}
+
+/*
+** Peephole optimization. The pass rewrites the decoded instructions in
+** place before the layout, while jump operands are still bytecode
+** indices. A removed instruction is marked BC_DEAD and a jump to it
+** goes to the next live instruction. The rewrites are repeated until
+** nothing changes:
+**   Ibyte a; Ibyte b; ...                 => Istr "ab..."
+**   Ialt L; Iset s; Isucc; L:             => Ioset s
+**   Ialt L; M: Iset s; Iskip M; L:        => Irset s
+**   Ialt L; Istr s; Isucc; Ifail; L:      => Instr s  (also Iostr, Inbyte)
+**   Icall X; Iret                         => Ijump X
+**   Ijump L; ... L: Ijump M               => Ijump M
+**   Ijump L; ... L: Iret                  => Iret
+**   instructions after an unconditional transfer that nothing jumps to
+** Before that, every instruction that no entry point reaches is dropped,
+** and afterwards the sets and strings that no instruction uses.
+** A byte or set operand stands for a singleton set where the pattern
+** needs a set; the pass adds such sets and fused strings to the pools.
+** Finally, the pairs that dispatch most often are fused into
+** superinstructions: Inbyte; Iany => Inbyteany, Instr; Iany => Instrany
+** and Iany; Iskip => Ianyskip. A repetition of the first two, such as
+** the body of a comment or a quoted string, becomes a scan:
+**   Ialt L; M: Inbyteany c; Iskip M; L:   => Iscanbyte c
+**   Ialt L; M: Instrany s; Iskip M; L:    => Iscanstr s
+**
+** An instruction that something else jumps to (or returns to) is never
+** folded into its predecessor. A tail call skips the memo table; the
+** calls it makes itself are still memoized. Like an inlined call, it no
+** longer counts in profiles: the callee runs in the caller's frame, which
+** is charged with its cost. Load with -O0 to profile it.
+*/
+#define BC_DEAD 0xff
+/* fused strings stay within the wide compare of pstring_starts_with */
+#define BC_STR_MAX 32
+
+typedef struct PeepholeOptimizer {
+  ByteCodeInst *bc;
+  unsigned size;
+  unsigned *refs;
+  struct Grammar *g;
+  /* the entry points, moved along with the code they start */
+  unsigned *entries;
+  unsigned entry_size;
+} PeepholeOptimizer;
+
+static unsigned liveIndex(PeepholeOptimizer *opt, unsigned i) {
+  while (i < opt->size && opt->bc[i].op == BC_DEAD) {
+    i++;
+  }
+  return i;
+}
+
+static unsigned nextLive(PeepholeOptimizer *opt, unsigned i) {
+  return liveIndex(opt, i + 1);
+}
+
+static int isLive(PeepholeOptimizer *opt, unsigned i, uint8_t op) {
+  return i < opt->size && opt->bc[i].op == op;
+}
+
+/* count the references to each instruction and normalize jump operands */
+static void countRefs(PeepholeOptimizer *opt) {
+  unsigned i;
+  memset(opt->refs, 0, sizeof(unsigned) * (opt->size + 1));
+  for (i = 0; i < opt->entry_size; i++) {
+    opt->entries[i] = liveIndex(opt, opt->entries[i]);
+    opt->refs[opt->entries[i]]++;
+  }
+  for (i = 0; i < opt->size; i++) {
+    ByteCodeInst *bc = &opt->bc[i];
+    if (bc->op == BC_DEAD) {
+      continue;
+    }
+    if (hasJumpOperand(bc->op)) {
+      assert(bc->arg <= opt->size);
+      bc->arg = liveIndex(opt, bc->arg);
+      opt->refs[bc->arg]++;
+    }
+    if (bc->op == MININEZ_OP_Icall) {
+      /* the return address */
+      opt->refs[nextLive(opt, i)]++;
+    }
+  }
+}
+
+/* size of a pool string allocated by pstring_alloc */
+static size_t pstringSize(unsigned len) {
+  return sizeof(pstring_t) + len + PSTRING_PADDING;
+}
+
+static unsigned internStr(struct Grammar *g, const char *text, unsigned len) {
+  unsigned i;
+  for (i = 0; i < g->str_size; i++) {
+    if (pstring_length(g->strs[i]) == len && memcmp(g->strs[i], text, len) == 0) {
+      return i;
+    }
+  }
+  g->strs = (const char **)realloc(g->strs, sizeof(const char *) * (g->str_size + 1));
+  g->strs[g->str_size] = pstring_alloc(text, len);
+  g->memory_size += sizeof(const char *) + pstringSize(len);
+  return g->str_size++;
+}
+
+static unsigned internSet(struct Grammar *g, bitset_t *set) {
+  unsigned i;
+  for (i = 0; i < g->set_size; i++) {
+    if (memcmp(&g->sets[i], set, sizeof(bitset_t)) == 0) {
+      return i;
+    }
+  }
+  g->sets = (bitset_t *)realloc(g->sets, sizeof(bitset_t) * (g->set_size + 1));
+  g->sets[g->set_size] = *set;
+  g->memory_size += sizeof(bitset_t);
+  return g->set_size++;
+}
+
+/* the set an Iset or Ibyte operand matches */
+static int operandSet(PeepholeOptimizer *opt, ByteCodeInst *bc, unsigned *set) {
+  bitset_t single;
+  if (bc->op == MININEZ_OP_Iset) {
+    *set = bc->arg;
+    return 1;
+  }
+  if (bc->op == MININEZ_OP_Ibyte) {
+    bitset_init(&single);
+    bitset_set(&single, bc->arg);
+    *set = internSet(opt->g, &single);
+    return 1;
+  }
+  return 0;
+}
+
+static void kill(PeepholeOptimizer *opt, unsigned i) {
+  opt->bc[i].op = BC_DEAD;
+}
+
+static int fuseBytes(PeepholeOptimizer *opt, unsigned i) {
+  char text[BC_STR_MAX];
+  unsigned len = 0, j = i, last = i;
+  while (isLive(opt, j, MININEZ_OP_Ibyte) && len < BC_STR_MAX
+      && (j == i || opt->refs[j] == 0)) {
+    text[len++] = (char)opt->bc[j].arg;
+    last = j;
+    j = nextLive(opt, j);
+  }
+  if (len < 2) {
+    return 0;
+  }
+  opt->bc[i].op = MININEZ_OP_Istr;
+  opt->bc[i].arg = internStr(opt->g, text, len);
+  for (j = nextLive(opt, i); j <= last; j = nextLive(opt, j)) {
+    kill(opt, j);
+  }
+  return 1;
+}
+
+/* Ialt L; e; Isucc; [Ifail;] L: */
+static int fuseAlt(PeepholeOptimizer *opt, unsigned i) {
+  unsigned e = nextLive(opt, i);
+  unsigned next = nextLive(opt, e);
+  unsigned end = opt->bc[i].arg;
+  unsigned set;
+  ByteCodeInst *bc = &opt->bc[e];
+  if (e >= opt->size) {
+    return 0;
+  }
+  if (isLive(opt, next, MININEZ_OP_Isucc) && opt->refs[e] == 0 && opt->refs[next] == 0) {
+    unsigned after = nextLive(opt, next);
+    if (after == end) {
+      /* optional */
+      if (bc->op == MININEZ_OP_Istr) {
+        opt->bc[i].op = MININEZ_OP_Iostr;
+        opt->bc[i].arg = bc->arg;
+      }
+      else if (operandSet(opt, bc, &set)) {
+        opt->bc[i].op = MININEZ_OP_Ioset;
+        opt->bc[i].arg = set;
+      }
+      else {
+        return 0;
+      }
+      kill(opt, e);
+      kill(opt, next);
+      return 1;
+    }
+    if (isLive(opt, after, MININEZ_OP_Ifail) && opt->refs[after] == 0
+        && nextLive(opt, after) == end) {
+      /* not predicate */
+      if (bc->op == MININEZ_OP_Istr) {
+        opt->bc[i].op = MININEZ_OP_Instr;
+      }
+      else if (bc->op == MININEZ_OP_Ibyte) {
+        opt->bc[i].op = MININEZ_OP_Inbyte;
+      }
+      else {
+        return 0;
+      }
+      opt->bc[i].arg = bc->arg;
+      kill(opt, e);
+      kill(opt, next);
+      kill(opt, after);
+      return 1;
+    }
+    return 0;
+  }
+  if (isLive(opt, next, MININEZ_OP_Iskip) && opt->refs[next] == 0
+      && opt->bc[next].arg == e && opt->refs[e] == 1
+      && nextLive(opt, next) == end) {
+    /* repetition; the Iskip is the only reference to e */
+    if (!operandSet(opt, bc, &set)) {
+      return 0;
+    }
+    opt->bc[i].op = MININEZ_OP_Irset;
+    opt->bc[i].arg = set;
+    kill(opt, e);
+    kill(opt, next);
+    return 1;
+  }
+  return 0;
+}
+
+static int isUnconditional(uint8_t op) {
+  switch (op) {
+    case MININEZ_OP_Ijump:
+    case MININEZ_OP_Iret:
+    case MININEZ_OP_Ifail:
+    case MININEZ_OP_Iexit:
+      return 1;
+  }
+  return 0;
+}
+
+static int peepholeRound(PeepholeOptimizer *opt) {
+  unsigned i;
+  int changed = 0;
+  countRefs(opt);
+  for (i = liveIndex(opt, 0); i < opt->size; i = nextLive(opt, i)) {
+    ByteCodeInst *bc = &opt->bc[i];
+    unsigned next = nextLive(opt, i);
+    int rewritten = 0;
+    switch (bc->op) {
+      case MININEZ_OP_Ibyte:
+        rewritten = fuseBytes(opt, i);
+        break;
+      case MININEZ_OP_Ialt:
+        rewritten = fuseAlt(opt, i);
+        break;
+      case MININEZ_OP_Icall:
+        if (isLive(opt, next, MININEZ_OP_Iret)) {
+          bc->op = MININEZ_OP_Ijump;
+          rewritten = 1;
+        }
+        break;
+      case MININEZ_OP_Ijump:
+        if (bc->arg == next) {
+          kill(opt, i);
+          rewritten = 1;
+        }
+        else if (isLive(opt, bc->arg, MININEZ_OP_Ijump) && opt->bc[bc->arg].arg != bc->arg) {
+          bc->arg = opt->bc[bc->arg].arg;
+          rewritten = 1;
+        }
+        else if (isLive(opt, bc->arg, MININEZ_OP_Iret)) {
+          bc->op = MININEZ_OP_Iret;
+          bc->arg = 0;
+          rewritten = 1;
+        }
+        break;
+    }
+    if (rewritten) {
+      /* a rewrite moves references; the later matches need exact counts */
+      countRefs(opt);
+      changed = 1;
+    }
+    if (bc->op != BC_DEAD && isUnconditional(bc->op)) {
+      next = nextLive(opt, i);
+      while (next < opt->size && opt->refs[next] == 0) {
+        kill(opt, next);
+        next = nextLive(opt, next);
+        changed = 1;
+      }
+    }
+  }
+  return changed;
+}
+
+/* the pairs that dispatched most often in the JSON and C-like grammars */
+static void fuseSuperInstructions(PeepholeOptimizer *opt) {
+  unsigned i;
+  countRefs(opt);
+  for (i = liveIndex(opt, 0); i < opt->size; i = nextLive(opt, i)) {
+    ByteCodeInst *bc = &opt->bc[i];
+    unsigned next = nextLive(opt, i);
+    uint8_t op;
+    if (next >= opt->size || opt->refs[next] != 0) {
+      continue;
+    }
+    op = opt->bc[next].op;
+    if (bc->op == MININEZ_OP_Inbyte && op == MININEZ_OP_Iany) {
+      bc->op = MININEZ_OP_Inbyteany;
+    }
+    else if (bc->op == MININEZ_OP_Instr && op == MININEZ_OP_Iany) {
+      bc->op = MININEZ_OP_Instrany;
+    }
+    else if (bc->op == MININEZ_OP_Iany && op == MININEZ_OP_Iskip) {
+      bc->op = MININEZ_OP_Ianyskip;
+      bc->arg = opt->bc[next].arg;
+    }
+    else {
+      continue;
+    }
+    kill(opt, next);
+  }
+}
+
+/* (!c .)* and (!"s" .)* after fuseSuperInstructions */
+static void fuseScans(PeepholeOptimizer *opt) {
+  unsigned i;
+  countRefs(opt);
+  for (i = liveIndex(opt, 0); i < opt->size; i = nextLive(opt, i)) {
+    ByteCodeInst *bc = &opt->bc[i];
+    unsigned e = nextLive(opt, i);
+    unsigned next = nextLive(opt, e);
+    if (bc->op != MININEZ_OP_Ialt || e >= opt->size) {
+      continue;
+    }
+    if (!isLive(opt, next, MININEZ_OP_Iskip) || opt->bc[next].arg != e
+        || opt->refs[e] != 1 || opt->refs[next] != 0 || nextLive(opt, next) != bc->arg) {
+      continue;
+    }
+    if (opt->bc[e].op == MININEZ_OP_Inbyteany) {
+      bc->op = MININEZ_OP_Iscanbyte;
+    }
+    else if (opt->bc[e].op == MININEZ_OP_Instrany) {
+      bc->op = MININEZ_OP_Iscanstr;
+    }
+    else {
+      continue;
+    }
+    bc->arg = opt->bc[e].arg;
+    kill(opt, e);
+    kill(opt, next);
+    countRefs(opt);
+  }
+}
+
+static unsigned liveCount(PeepholeOptimizer *opt) {
+  unsigned i, n = 0;
+  for (i = 0; i < opt->size; i++) {
+    if (opt->bc[i].op != BC_DEAD) {
+      n += instructionWidth(opt->bc[i].op);
+    }
+  }
+  return n;
+}
+
+/* drop the dead instructions; returns the new instruction count */
+static unsigned compactByteCode(PeepholeOptimizer *opt) {
+  unsigned i, n = 0;
+  unsigned *index = opt->refs;
+  for (i = 0; i < opt->size; i++) {
+    index[i] = n;
+    if (opt->bc[i].op != BC_DEAD) {
+      n++;
+    }
+  }
+  index[opt->size] = n;
+  for (i = 0; i < opt->size; i++) {
+    ByteCodeInst *bc = &opt->bc[i];
+    if (bc->op == BC_DEAD) {
+      continue;
+    }
+    if (hasJumpOperand(bc->op)) {
+      bc->arg = index[liveIndex(opt, bc->arg)];
+    }
+    opt->bc[index[i]] = *bc;
+  }
+  for (i = 0; i < opt->entry_size; i++) {
+    opt->entries[i] = index[liveIndex(opt, opt->entries[i])];
+  }
+  return n;
+}
+
+/* returns the number of productions (Ilabel) dropped */
+static unsigned pruneUnreachable(PeepholeOptimizer *opt) {
+  unsigned char *reached = (unsigned char *)calloc(opt->size + 1, 1);
+  unsigned *work = (unsigned *)malloc(sizeof(unsigned) * (2 * opt->size + opt->entry_size + 1));
+  unsigned i, n = 0, dropped = 0;
+  for (i = 0; i < opt->entry_size; i++) {
+    work[n++] = opt->entries[i];
+  }
+  while (n > 0) {
+    ByteCodeInst *bc;
+    i = work[--n];
+    if (i >= opt->size || reached[i]) {
+      continue;
+    }
+    reached[i] = 1;
+    bc = &opt->bc[i];
+    if (hasJumpOperand(bc->op)) {
+      work[n++] = bc->arg;
+    }
+    if (!isUnconditional(bc->op)) {
+      work[n++] = i + 1;
+    }
+  }
+  for (i = 0; i < opt->size; i++) {
+    if (!reached[i] && opt->bc[i].op != BC_DEAD) {
+      dropped += opt->bc[i].op == MININEZ_OP_Ilabel;
+      kill(opt, i);
+    }
+  }
+  free(work);
+  free(reached);
+  return dropped;
+}
+
+static int usesStr(uint8_t op) {
+  switch (op) {
+    case MININEZ_OP_Istr:
+    case MININEZ_OP_Instr:
+    case MININEZ_OP_Iostr:
+    case MININEZ_OP_Instrany:
+    case MININEZ_OP_Iscanstr:
+      return 1;
+  }
+  return 0;
+}
+
+static int usesSet(uint8_t op) {
+  switch (op) {
+    case MININEZ_OP_Iset:
+    case MININEZ_OP_Ioset:
+    case MININEZ_OP_Irset:
+      return 1;
+  }
+  return 0;
+}
+
+/* drop the strings and sets of pruned or fused code, renumbering the operands */
+static void compactPools(ByteCodeInst *bc, unsigned size, struct Grammar *g) {
+  unsigned *str_index = (unsigned *)malloc(sizeof(unsigned) * (g->str_size + 1));
+  unsigned *set_index = (unsigned *)malloc(sizeof(unsigned) * (g->set_size + 1));
+  unsigned strs = 0, sets = 0, i;
+  for (i = 0; i < g->str_size; i++) {
+    str_index[i] = 0;
+  }
+  for (i = 0; i < g->set_size; i++) {
+    set_index[i] = 0;
+  }
+  for (i = 0; i < size; i++) {
+    if (usesStr(bc[i].op)) {
+      str_index[bc[i].arg] = 1;
+    }
+    else if (usesSet(bc[i].op)) {
+      set_index[bc[i].arg] = 1;
+    }
+  }
+  for (i = 0; i < g->str_size; i++) {
+    if (str_index[i]) {
+      str_index[i] = strs;
+      g->strs[strs++] = g->strs[i];
+    }
+    else {
+      g->memory_size -= sizeof(const char *) + pstringSize(pstring_length(g->strs[i]));
+      pstring_delete(g->strs[i]);
+    }
+  }
+  for (i = 0; i < g->set_size; i++) {
+    if (set_index[i]) {
+      set_index[i] = sets;
+      g->sets[sets++] = g->sets[i];
+    }
+    else {
+      g->memory_size -= sizeof(bitset_t);
+    }
+  }
+  for (i = 0; i < size; i++) {
+    if (usesStr(bc[i].op)) {
+      bc[i].arg = str_index[bc[i].arg];
+    }
+    else if (usesSet(bc[i].op)) {
+      bc[i].arg = set_index[bc[i].arg];
+    }
+  }
+  if (g->verbose) {
+    fprintf(stderr, "pool: %u => %u strings, %u => %u sets\n",
+        g->str_size, strs, g->set_size, sets);
+  }
+  g->str_size = strs;
+  g->set_size = sets;
+  free(str_index);
+  free(set_index);
+}
+
+/*
+** Inlining. A call to a production whose body is at most inline_size
+** instructions, calls nothing, branches only within itself and leaves
+** only through Iret is replaced by a copy of the body, its Iret becoming
+** a jump to the instruction after the call. A caller that is left
+** without calls may be inlined in the next round, so nesting is
+** flattened bottom up; a recursive production always keeps a call and
+** is never inlined. The productions no longer called are then dropped
+** by pruneUnreachable, and the jumps to the next instruction by the
+** peephole pass. The inlined calls no longer count in profiles or take
+** memo entries; load with -O0 (or inline_size 0) to profile them.
+*/
+#define INLINE_ROUNDS 4
+
+/* the end of the production at label, or 0 if its calls cannot be inlined */
+static unsigned inlineBodyEnd(ByteCodeInst *bc, unsigned size, unsigned label,
+    unsigned inline_size) {
+  unsigned i, end;
+  if (label >= size || bc[label].op != MININEZ_OP_Ilabel) {
+    return 0;
+  }
+  for (end = label + 1; end < size && bc[end].op != MININEZ_OP_Ilabel; end++) {
+  }
+  if (end - label - 1 == 0 || end - label - 1 > inline_size || !isUnconditional(bc[end - 1].op)) {
+    return 0;
+  }
+  for (i = label + 1; i < end; i++) {
+    if (bc[i].op == MININEZ_OP_Icall || bc[i].op == MININEZ_OP_Iexit) {
+      return 0;
+    }
+    if (hasJumpOperand(bc[i].op) && (bc[i].arg <= label || bc[i].arg >= end)) {
+      return 0;
+    }
+  }
+  return end;
+}
+
+static unsigned inlineCalls(ByteCodeInst **bcp, unsigned size, struct Grammar *g,
+    unsigned *entries, unsigned entry_size, unsigned inline_size) {
+  unsigned before = size, sites = 0, round;
+  for (round = 0; round < INLINE_ROUNDS; round++) {
+    ByteCodeInst *bc = *bcp;
+    ByteCodeInst *out;
+    unsigned *end = (unsigned *)calloc(size + 1, sizeof(unsigned));
+    unsigned *index = (unsigned *)malloc(sizeof(unsigned) * (size + 1));
+    unsigned i, n = 0, inlined = 0;
+    for (i = 0; i < size; i++) {
+      if (bc[i].op == MININEZ_OP_Ilabel) {
+        end[i] = inlineBodyEnd(bc, size, i, inline_size);
+      }
+    }
+    for (i = 0; i < size; i++) {
+      unsigned callee = bc[i].arg;
+      index[i] = n;
+      if (bc[i].op == MININEZ_OP_Icall && callee < size && end[callee] != 0) {
+        n += end[callee] - callee - 1;
+        inlined++;
+      }
+      else {
+        n++;
+      }
+    }
+    index[size] = n;
+    if (inlined == 0) {
+      free(end);
+      free(index);
+      break;
+    }
+    out = (ByteCodeInst *)malloc(sizeof(ByteCodeInst) * (n + 1));
+    for (i = 0; i < size; i++) {
+      unsigned callee = bc[i].arg;
+      if (bc[i].op == MININEZ_OP_Icall && callee < size && end[callee] != 0) {
+        unsigned k, base = index[i];
+        for (k = callee + 1; k < end[callee]; k++) {
+          ByteCodeInst *copy = &out[base + k - callee - 1];
+          *copy = bc[k];
+          if (copy->op == MININEZ_OP_Iret) {
+            copy->op = MININEZ_OP_Ijump;
+            copy->arg = index[i + 1];
+          }
+          else if (hasJumpOperand(copy->op)) {
+            copy->arg = base + copy->arg - callee - 1;
+          }
+        }
+        continue;
+      }
+      out[index[i]] = bc[i];
+      if (hasJumpOperand(bc[i].op)) {
+        out[index[i]].arg = index[bc[i].arg];
+      }
+    }
+    for (i = 0; i < entry_size; i++) {
+      entries[i] = index[entries[i]];
+    }
+    free(end);
+    free(index);
+    free(bc);
+    *bcp = out;
+    size = n;
+    sites += inlined;
+  }
+  if (g->verbose) {
+    fprintf(stderr, "inline: %u call sites, %u => %u instructions\n", sites, before, size);
+  }
+  return size;
+}
+
+static unsigned optimizeByteCode(ByteCodeInst *bc, unsigned size, struct Grammar *g, int trace,
+    unsigned *entries, unsigned entry_size) {
+  PeepholeOptimizer opt;
+  unsigned before, after, pruned;
+  opt.bc = bc;
+  opt.size = size;
+  opt.refs = (unsigned *)malloc(sizeof(unsigned) * (size + 1));
+  opt.g = g;
+  opt.entries = entries;
+  opt.entry_size = entry_size;
+  before = liveCount(&opt);
+  pruned = pruneUnreachable(&opt);
+  if (!trace) {
+    unsigned i;
+    /* Ilabel only names the nonterminal in traces */
+    for (i = 0; i < size; i++) {
+      if (bc[i].op == MININEZ_OP_Ilabel) {
+        kill(&opt, i);
+      }
+    }
+  }
+  while (peepholeRound(&opt)) {
+  }
+  fuseSuperInstructions(&opt);
+  fuseScans(&opt);
+  after = liveCount(&opt);
+  size = compactByteCode(&opt);
+  free(opt.refs);
+  if (g->verbose) {
+    fprintf(stderr, "prune: %u unreachable productions\n", pruned);
+    fprintf(stderr, "peephole: %u => %u instructions\n", before, after);
+  }
+  compactPools(bc, size, g);
+  if (trace) {
+    unsigned i;
+    for (i = 0; i < size; i++) {
+      fprintf(stderr, "[%u]%s %u\n", i, get_opname(bc[i].op), bc[i].arg);
+    }
+  }
+  return size;
+}
+
+/*
+** FIRST-set dispatch. An Ialt whose failure target is another Ialt
+** starts a chain p0, p1, ..., pn: each pk (k < n) guards one
+** alternative, and pn is where the last alternative fails to. If the
+** next byte cannot start the alternative guarded by pk, that
+** alternative fails without consuming input, so entering the chain at
+** pk+1 instead is equivalent. An Ifirst in front of p0 therefore looks
+** up the next byte in a 256-entry table holding the first pk whose
+** alternative can start with it, and skips the push, the failed test
+** and the restore of every alternative before it.
+**
+** The FIRST set of an alternative is computed over the instructions up
+** to the Isucc that pops its frame. An alternative that can reach it
+** without consuming input is viable for every byte. Calls use per-rule
+** summaries, iterated to a fixed point. The sets are conservative: a
+** byte that is not in a set can never start that alternative.
+*/
+#define FIRST_BUDGET 4096
+
+typedef struct FirstSet {
+  bitset_t set;
+  int reach;  /* reached the frame pop (or the rule's Iret) */
+} FirstSet;
+
+typedef struct FirstAnalysis {
+  ByteCodeInst *bc;
+  unsigned size;
+  struct Grammar *g;
+  FirstSet *summary;  /* indexed by the entry of a rule */
+  unsigned budget;
+} FirstAnalysis;
+
+static void firstSetAll(FirstSet *out) {
+  memset(&out->set, 0xff, sizeof(bitset_t));
+  out->reach = 1;
+}
+
+static void firstSetUnion(bitset_t *dst, bitset_t *src) {
+  unsigned i;
+  for (i = 0; i < 256 / BITS; i++) {
+    dst->data[i] |= src->data[i];
+  }
+}
+
+/* every byte but the end-of-input sentinel (and c, if c != 0) */
+static void firstSetAny(FirstSet *out, unsigned c) {
+  bitset_t any;
+  memset(&any, 0xff, sizeof(bitset_t));
+  any.data[0] &= ~(bitset_entry_t)1;
+  any.data[c / BITS] &= ~(((bitset_entry_t)1) << (c % BITS));
+  firstSetUnion(&out->set, &any);
+}
+
+static void firstOf(FirstAnalysis *fa, unsigned p, unsigned depth, int rule, FirstSet *out) {
+  while (1) {
+    ByteCodeInst *bc;
+    const char *str;
+    if (p >= fa->size || fa->budget == 0) {
+      firstSetAll(out);
+      return;
+    }
+    fa->budget--;
+    bc = &fa->bc[p];
+    switch (bc->op) {
+      case MININEZ_OP_Ibyte:
+        bitset_set(&out->set, bc->arg);
+        return;
+      case MININEZ_OP_Iset:
+        firstSetUnion(&out->set, &fa->g->sets[bc->arg]);
+        return;
+      case MININEZ_OP_Iany:
+      case MININEZ_OP_Instrany:
+      case MININEZ_OP_Ianyskip:
+        firstSetAny(out, 0);
+        return;
+      case MININEZ_OP_Inbyteany:
+        firstSetAny(out, bc->arg);
+        return;
+      case MININEZ_OP_Istr:
+      case MININEZ_OP_Iostr:
+        str = fa->g->strs[bc->arg];
+        if (pstring_length(str) > 0) {
+          bitset_set(&out->set, (uint8_t)str[0]);
+          if (bc->op == MININEZ_OP_Istr) {
+            return;
+          }
+        }
+        break;
+      case MININEZ_OP_Ioset:
+      case MININEZ_OP_Irset:
+        firstSetUnion(&out->set, &fa->g->sets[bc->arg]);
+        break;
+      case MININEZ_OP_Iscanbyte:
+        firstSetAny(out, bc->arg);
+        break;
+      case MININEZ_OP_Iscanstr:
+        firstSetAny(out, 0);
+        break;
+      case MININEZ_OP_Inbyte:
+      case MININEZ_OP_Instr:
+      case MININEZ_OP_Ipos:
+      case MININEZ_OP_Iback:
+      case MININEZ_OP_Inop:
+      case MININEZ_OP_Ilabel:
+      case MININEZ_OP_Inew:
+      case MININEZ_OP_Itag:
+      case MININEZ_OP_Ilink:
+      case MININEZ_OP_Icapture:
+        break;
+      case MININEZ_OP_Ifail:
+      case MININEZ_OP_Iskip:
+        /* an Iskip that made no progress fails to its frame's target */
+        return;
+      case MININEZ_OP_Ijump:
+        p = bc->arg;
+        continue;
+      case MININEZ_OP_Ialt:
+        firstOf(fa, bc->arg, depth, rule, out);
+        depth++;
+        break;
+      case MININEZ_OP_Isucc:
+        if (depth == 0) {
+          if (rule) {
+            firstSetAll(out);
+          }
+          out->reach = 1;
+          return;
+        }
+        depth--;
+        break;
+      case MININEZ_OP_Icall: {
+        FirstSet *callee = &fa->summary[bc->arg];
+        firstSetUnion(&out->set, &callee->set);
+        if (!callee->reach) {
+          return;
+        }
+        break;
+      }
+      case MININEZ_OP_Iret:
+        if (!rule || depth != 0) {
+          firstSetAll(out);
+        }
+        out->reach = 1;
+        return;
+      default:
+        firstSetAll(out);
+        return;
+    }
+    p++;
+  }
+}
+
+static void analyzeRules(FirstAnalysis *fa) {
+  unsigned char *entry = (unsigned char *)calloc(fa->size + 1, 1);
+  unsigned i, round;
+  int changed = 1;
+  for (i = 0; i < fa->size; i++) {
+    if (fa->bc[i].op == MININEZ_OP_Icall) {
+      entry[fa->bc[i].arg] = 1;
+    }
+  }
+  memset(fa->summary, 0, sizeof(FirstSet) * (fa->size + 1));
+  for (round = 0; changed && round < 256; round++) {
+    changed = 0;
+    for (i = 0; i < fa->size; i++) {
+      FirstSet s;
+      if (!entry[i]) {
+        continue;
+      }
+      memset(&s, 0, sizeof(s));
+      fa->budget = FIRST_BUDGET;
+      firstOf(fa, i, 0, 1, &s);
+      if (memcmp(&s, &fa->summary[i], sizeof(s)) != 0) {
+        fa->summary[i] = s;
+        changed = 1;
+      }
+    }
+  }
+  if (changed) {
+    /* no fixed point; give up on precision rather than be wrong */
+    for (i = 0; i < fa->size; i++) {
+      firstSetAll(&fa->summary[i]);
+    }
+  }
+  free(entry);
+}
+
+/* returns the table index, or -1 if the chain at p0 gains nothing */
+static int buildFirstTable(FirstAnalysis *fa, unsigned p0) {
+  struct Grammar *g = fa->g;
+  MiniNezJumpTable table;
+  FirstSet first[64];
+  unsigned chain[65];
+  unsigned n = 0, p = p0, c, k;
+  int useful = 0;
+  while (p < fa->size && fa->bc[p].op == MININEZ_OP_Ialt && n < 64) {
+    chain[n] = p;
+    memset(&first[n], 0, sizeof(FirstSet));
+    fa->budget = FIRST_BUDGET;
+    firstOf(fa, p + 1, 0, 0, &first[n]);
+    if (first[n].reach) {
+      firstSetAll(&first[n]);
+    }
+    p = fa->bc[p].arg;
+    n++;
+  }
+  chain[n] = p;
+  if (n < 2) {
+    return -1;
+  }
+  for (c = 0; c < 256; c++) {
+    for (k = 0; k < n; k++) {
+      if (bitset_get(&first[k].set, (unsigned char)c)) {
+        break;
+      }
+    }
+    table.target[c] = chain[k];
+    useful |= k > 0;
+  }
+  if (!useful) {
+    return -1;
+  }
+  g->jump_tables = (MiniNezJumpTable *)realloc(g->jump_tables,
+      sizeof(MiniNezJumpTable) * (g->jump_table_size + 1));
+  g->jump_tables[g->jump_table_size] = table;
+  g->memory_size += sizeof(MiniNezJumpTable);
+  return (int)g->jump_table_size++;
+}
+
+static unsigned insertFirstDispatch(ByteCodeInst **bcp, unsigned size, struct Grammar *g,
+    unsigned *entries, unsigned entry_size) {
+  ByteCodeInst *bc = *bcp;
+  ByteCodeInst *out;
+  FirstAnalysis fa;
+  unsigned char *continuation = (unsigned char *)calloc(size + 1, 1);
+  int *table = (int *)malloc(sizeof(int) * (size + 1));
+  unsigned *jump = (unsigned *)malloc(sizeof(unsigned) * (size + 1));
+  unsigned *self = (unsigned *)malloc(sizeof(unsigned) * (size + 1));
+  unsigned first_table = g->jump_table_size;
+  unsigned i, t, n = 0, heads = 0;
+
+  fa.bc = bc;
+  fa.size = size;
+  fa.g = g;
+  fa.summary = (FirstSet *)malloc(sizeof(FirstSet) * (size + 1));
+  analyzeRules(&fa);
+  for (i = 0; i < size; i++) {
+    if (bc[i].op == MININEZ_OP_Ialt && bc[i].arg < size) {
+      continuation[bc[i].arg] = 1;
+    }
+  }
+  for (i = 0; i < size; i++) {
+    table[i] = -1;
+    if (bc[i].op == MININEZ_OP_Ialt && !continuation[i]) {
+      table[i] = buildFirstTable(&fa, i);
+      heads += table[i] >= 0;
+    }
+  }
+
+  out = (ByteCodeInst *)malloc(sizeof(ByteCodeInst) * (size + heads + 1));
+  for (i = 0; i < size; i++) {
+    jump[i] = n;
+    if (table[i] >= 0) {
+      out[n].op = MININEZ_OP_Ifirst;
+      out[n].arg = (unsigned)table[i];
+      out[n].nterm = 0;
+      n++;
+    }
+    self[i] = n;
+    out[n++] = bc[i];
+  }
+  jump[size] = self[size] = n;
+  for (i = 0; i < n; i++) {
+    if (hasJumpOperand(out[i].op)) {
+      out[i].arg = jump[out[i].arg];
+    }
+  }
+  for (t = first_table; t < g->jump_table_size; t++) {
+    unsigned c;
+    for (c = 0; c < 256; c++) {
+      g->jump_tables[t].target[c] = self[g->jump_tables[t].target[c]];
+    }
+  }
+  for (i = 0; i < entry_size; i++) {
+    entries[i] = jump[entries[i]];
+  }
+  if (g->verbose) {
+    fprintf(stderr, "first: %u choices dispatched\n", heads);
+  }
+
+  free(fa.summary);
+  free(continuation);
+  free(table);
+  free(jump);
+  free(self);
+  free(bc);
+  *bcp = out;
+  return n;
+}
+
+/*
+** Operands are trusted from here on: jump targets stay within the code
+** and pool indices within their pools, and only opcodes of the bytecode
+** format occur (not the VM's own superinstructions).
+*/
+static const char *validateByteCode(ByteCodeInst *bc, unsigned size, struct Grammar *g) {
+  unsigned i;
+  for (i = 0; i < size; i++) {
+    unsigned arg = bc[i].arg;
+    switch (bc[i].op) {
+      case MININEZ_OP_Imemofail:
+      case MININEZ_OP_Imemosucc:
+        return "bytecode error: unknown instruction";
+      case MININEZ_OP_Icall:
+        if (bc[i].nterm >= g->nterm_size) {
+          return "bytecode error: nonterminal out of range";
+        }
+        break;
+      case MININEZ_OP_Ilabel:
+        if (arg >= g->nterm_size) {
+          return "bytecode error: nonterminal out of range";
+        }
+        break;
+      case MININEZ_OP_Istr:
+      case MININEZ_OP_Instr:
+      case MININEZ_OP_Iostr:
+        if (arg >= g->str_size) {
+          return "bytecode error: string out of range";
+        }
+        break;
+      case MININEZ_OP_Iset:
+      case MININEZ_OP_Ioset:
+      case MININEZ_OP_Irset:
+        if (arg >= g->set_size) {
+          return "bytecode error: set out of range";
+        }
+        break;
+      case MININEZ_OP_Itag:
+        if (arg >= g->tag_size) {
+          return "bytecode error: tag out of range";
+        }
+        break;
+    }
+    if (bc[i].op >= MININEZ_OP_Inbyteany) {
+      return "bytecode error: unknown instruction";
+    }
+    if (hasJumpOperand(bc[i].op) && arg >= size) {
+      return "bytecode error: jump target out of range";
+    }
+  }
+  return NULL;
+}
+
+/*
+** The entry points named by start_point (nonterminals separated by
+** commas or spaces), as the bytecode indices of their Ilabel. Without
+** names, the bytecode starts with the first production.
+*/
+static unsigned *resolveEntries(ByteCodeInst *bc, unsigned size, struct Grammar *g,
+    const char *start_point, const char **error) {
+  const char *p = start_point != NULL ? start_point : "";
+  unsigned *entries = (unsigned *)malloc(sizeof(unsigned) * (strlen(p) / 2 + 1));
+  unsigned i, n = 0;
+  while (*p != '\0') {
+    size_t len = strcspn(p, ", ");
+    unsigned id, k;
+    if (len == 0) {
+      p++;
+      continue;
+    }
+    for (id = 0; id < g->nterm_size; id++) {
+      if (pstring_length(g->nterms[id]) == len && memcmp(g->nterms[id], p, len) == 0) {
+        break;
+      }
+    }
+    for (i = 0; i < size; i++) {
+      if (bc[i].op == MININEZ_OP_Ilabel && bc[i].arg == id) {
+        break;
+      }
+    }
+    if (i == size) {
+      *error = id == g->nterm_size ? "start point error: no such nonterminal"
+          : "start point error: the nonterminal has no production";
+      free(entries);
+      return NULL;
+    }
+    for (k = 0; k < n && entries[k] != i; k++) {
+    }
+    if (k == n) {
+      entries[n++] = i;
+    }
+    p += len;
+  }
+  if (n == 0) {
+    entries[n++] = 0;
+  }
+  g->entries = (MiniNezEntry *)malloc(sizeof(MiniNezEntry) * n);
+  g->entry_size = n;
+  g->memory_size += sizeof(MiniNezEntry) * n;
+  for (i = 0; i < n; i++) {
+    ByteCodeInst *label = &bc[entries[i]];
+    g->entries[i].nterm = entries[i] < size && label->op == MININEZ_OP_Ilabel
+        ? label->arg : g->nterm_size;
+  }
+  return entries;
+}
+
+MiniNezInstruction* loadMiniNezInstruction(ByteCodeLoader *loader, struct Grammar *g) {
+  unsigned i;
+  unsigned size = loader->info->instSize;
+  ByteCodeInst* bc = (ByteCodeInst*) malloc(sizeof(ByteCodeInst) * (size + 1));
+  unsigned* entries = NULL;
+  unsigned* addr;
+  MiniNezInstruction* head;
+  MiniNezInstruction* ir;
+  unsigned len = MININEZ_INST_OFFSET;
+
+  decodeByteCode(bc, loader);
+  if (loader->info->truncated) {
+    loader->error = "bytecode error: the file ends in the middle of the instructions";
+  }
+  if (loader->error == NULL) {
+    loader->error = validateByteCode(bc, size, g);
+  }
+  if (loader->error == NULL) {
+    entries = resolveEntries(bc, size, g, loader->start_point, &loader->error);
+  }
+  if (loader->error != NULL) {
+    free(bc);
+    return NULL;
+  }
+  if (loader->optimize) {
+    size = inlineCalls(&bc, size, g, entries, g->entry_size, loader->inline_size);
+    size = optimizeByteCode(bc, size, g, loader->trace, entries, g->entry_size);
+    size = insertFirstDispatch(&bc, size, g, entries, g->entry_size);
+  }
+  addr = (unsigned*) malloc(sizeof(unsigned) * (size + 1));
+  for(i = 0; i < size; i++) {
+    addr[i] = len;
+    len += instructionWidth(bc[i].op);
+  }
+  addr[size] = len;
+  if (len > MININEZ_INST_ARG_MAX) {
+    loader->error = "bytecode error: too many instructions";
+    free(entries);
+    free(addr);
+    free(bc);
+    return NULL;
+  }
+
+  head = ir = VM_MALLOC(sizeof(*ir) * len);
+  memset(head, 0, sizeof(*ir) * len);
+  g->inst_size = len;
+  g->memory_size += sizeof(*ir) * len;
+
+  // exit fail case
+  ir->op = MININEZ_OP_Iexit;
+  ir->arg = 0;
+  ir++;
+  // exit success case
+  ir->op = MININEZ_OP_Iexit;
+  ir->arg = 1;
+  ir++;
+  // memoized call failed
+  ir->op = MININEZ_OP_Imemofail;
+  ir->arg = 0;
+  ir++;
+  // memoized call succeeded
+  ir->op = MININEZ_OP_Imemosucc;
+  ir->arg = 0;
+  ir++;
+
+  for(i = 0; i < size; i++) {
+    ir->op = bc[i].op;
+    ir->arg = bc[i].arg;
+    if (hasJumpOperand(bc[i].op)) {
+      assert(bc[i].arg < size);
+      ir->arg = addr[bc[i].arg];
+    }
     ir++;
+    if (bc[i].op == MININEZ_OP_Icall) {
+      /* extension word */
+      ir->op = MININEZ_OP_Inop;
+      ir->arg = bc[i].nterm;
+      ir++;
+    }
+  }
+  for (i = 0; i < g->jump_table_size; i++) {
+    unsigned c;
+    for (c = 0; c < 256; c++) {
+      g->jump_tables[i].target[c] = addr[g->jump_tables[i].target[c]];
+    }
+  }
+  for (i = 0; i < g->entry_size; i++) {
+    g->entries[i].addr = addr[entries[i]];
+  }
+  free(entries);
+  free(addr);
+  free(bc);
+  return head;
+}
+
+/*
+** Partition the bytes into equivalence classes of the set pool, one set
+** at a time: two bytes stay in one class only if every set so far
+** contains both or neither. The VM then tests a byte with one lookup in
+** the shared 256-byte class map and one bit in a row of a few bytes,
+** instead of a 32-byte bitset per set.
+*/
+static void compressSets(struct Grammar *g) {
+  uint8_t byte_class[256];
+  int split[512];
+  unsigned i, c, k = 1;
+  size_t row;
+  memset(byte_class, 0, sizeof(byte_class));
+  for (i = 0; i < g->set_size; i++) {
+    unsigned n = 0;
+    for (c = 0; c < 2 * k; c++) {
+      split[c] = -1;
+    }
+    for (c = 0; c < 256; c++) {
+      unsigned key = byte_class[c] * 2 + bitset_get(&g->sets[i], (unsigned char)c);
+      if (split[key] < 0) {
+        split[key] = (int)n++;
+      }
+      byte_class[c] = (uint8_t)split[key];
+    }
+    k = n;
+  }
+  g->class_size = k;
+  g->class_shift = 0;
+  while ((1U << g->class_shift) * 8 < k) {
+    g->class_shift++;
+  }
+  row = (size_t)1 << g->class_shift;
+  g->byte_class = (uint8_t *) VM_MALLOC(256);
+  memcpy(g->byte_class, byte_class, 256);
+  g->class_sets = (uint8_t *) VM_MALLOC(row * g->set_size + 1);
+  memset(g->class_sets, 0, row * g->set_size + 1);
+  for (i = 0; i < g->set_size; i++) {
+    uint8_t *bits = g->class_sets + row * i;
+    for (c = 0; c < 256; c++) {
+      if (bitset_get(&g->sets[i], (unsigned char)c)) {
+        bits[byte_class[c] >> 3] |= 1 << (byte_class[c] & 7);
+      }
+    }
+  }
+  g->memory_size += 256 + row * g->set_size;
+  if (g->verbose) {
+    fprintf(stderr, "set: %zu => %zu [byte] (%u byte classes)\n",
+        sizeof(bitset_t) * g->set_size, 256 + row * g->set_size, k);
   }
 }
 
-MiniNezInstruction* loadMachineCode(Context ctx, const char* code_file, const char* start_point) {
+/* nibble tables for the Irset scan; sets may have been added by the optimizer */
+static void compileCharClasses(struct Grammar *g) {
+  unsigned i;
+  g->charclass_kernel = charclass_select();
+  if (g->set_size == 0) {
+    return;
+  }
+  g->classes = (charclass_t *) VM_MALLOC(sizeof(charclass_t) * g->set_size);
+  g->memory_size += sizeof(charclass_t) * g->set_size;
+  for (i = 0; i < g->set_size; i++) {
+    charclass_init(&g->classes[i], &g->sets[i]);
+  }
+}
+
+/* read a pool of strings as pstrings; 0 if the bytecode ends inside it */
+static int loadStringPool(char *buf, ByteCodeInfo *info, const char **pool, unsigned size,
+    size_t *memory_size) {
+  unsigned i;
+  for (i = 0; i < size; i++) {
+    uint16_t len = read16(buf, info);
+    if (!available(info, (size_t)len + 1)) {
+      return 0;
+    }
+    pool[i] = pstring_alloc(peek(buf, info), (unsigned)len);
+    skip(info, len + 1);
+    *memory_size += pstringSize(len);
+  }
+  return 1;
+}
+
+/*
+** Load a grammar from bytecode in memory. Malformed bytecode is rejected
+** with a message in *error rather than trusted: every read is bounds
+** checked and every operand is validated before the optimizer or the VM
+** sees it. Nothing is written to stderr unless flags ask for it.
+*/
+Grammar mininez_LoadGrammar(const void *code, size_t code_length, const char *start_point,
+    int flags, const char **error) {
+  struct Grammar *g = (struct Grammar *) calloc(1, sizeof(struct Grammar));
+  char *buf = (char *)code;
+  int trace = (flags & MININEZ_LOAD_TRACE) != 0;
   unsigned i;
-  MiniNezInstruction* inst = NULL;
-  MiniNezInstruction* head = NULL;
-  size_t code_length;
-  char* buf = loadFile(code_file, &code_length);
   ByteCodeInfo info;
+  ByteCodeLoader loader;
+  memset(&info, 0, sizeof(info));
   info.code_length = code_length;
   info.pos = 0;
+  g->verbose = (flags & MININEZ_LOAD_VERBOSE) != 0;
+  if (mininez_IsGrammarImage(code, code_length)) {
+    *error = "image error: grammar images are mapped from a file (mininez_LoadGrammarFile)";
+    VM_FREE(g);
+    return NULL;
+  }
 
-#if MININEZ_DEBUG == 1
-  fprintf(stderr, "Bytecode file size: %zu[byte]\n", code_length);
-#endif
+  if (trace) {
+    fprintf(stderr, "Bytecode file size: %zu[byte]\n", code_length);
+  }
 
   /* load bytecode header */
 
@@ -333,35 +1680,35 @@ MiniNezInstruction* loadMachineCode(Context ctx, const char* code_file, const ch
   /* load instruction size */
   info.instSize = read16(buf, &info);
 
-  read16(buf, &info); // mininez doesn't use memo size
+  /* load memo size */
+  info.memoSize = read16(buf, &info);
 
   /* load jump table size */
   info.jmpTableSize = read16(buf, &info);
 
   info.nonTermPoolSize = read16(buf, &info);
+  g->nterm_size = info.nonTermPoolSize;
   if(info.nonTermPoolSize > 0) {
-    ctx->nterms = (const char**) malloc(sizeof(const char*) * info.nonTermPoolSize);
-    for(i = 0; i < info.nonTermPoolSize; i++) {
-      uint16_t len = read16(buf, &info);
-      char* str = peek(buf, &info);
-      skip(&info, len+1);
-      ctx->nterms[i] = pstring_alloc(str, (unsigned)len);
-#if MININEZ_DEBUG == 1
-      fprintf(stderr, "nterm[%d]: %s\n", i, ctx->nterms[i]);
-#endif
+    g->nterms = (const char**) calloc(info.nonTermPoolSize, sizeof(const char*));
+    if (!loadStringPool(buf, &info, g->nterms, info.nonTermPoolSize, &g->memory_size)) {
+      goto truncated;
+    }
+    if (trace) {
+      for(i = 0; i < info.nonTermPoolSize; i++) {
+        fprintf(stderr, "nterm[%d]: %s\n", i, g->nterms[i]);
+      }
     }
   }
 
-  malloc_size = 0;
   info.setPoolSize = read16(buf, &info);
   if(info.setPoolSize > 0) {
-    ctx->sets = (bitset_t*) VM_MALLOC(sizeof(bitset_t) * info.setPoolSize);
+    g->sets = (bitset_t*) VM_MALLOC(sizeof(bitset_t) * info.setPoolSize);
+    g->memory_size += sizeof(bitset_t) * info.setPoolSize;
 #define INT_BIT (sizeof(int) * CHAR_BIT)
-#define N (256 / INT_BIT)
     for (i = 0; i < info.setPoolSize; i++) {
       unsigned j, k;
       char debug_buf[512] = {};
-      bitset_t *set = &ctx->sets[i];
+      bitset_t *set = &g->sets[i];
       bitset_init(set);
       for (j = 0; j < 256/INT_BIT; j++) {
         unsigned v = read32(buf, &info);
@@ -372,52 +1719,183 @@ MiniNezInstruction* loadMachineCode(Context ctx, const char* code_file, const ch
           }
         }
       }
-#if MININEZ_DEBUG == 1
-      dump_set(set, debug_buf);
-      fprintf(stderr, "set: %s\n", debug_buf);
-#endif
+      if (trace) {
+        dump_set(set, debug_buf);
+        fprintf(stderr, "set: %s\n", debug_buf);
+      }
     }
+#undef INT_BIT
   }
 
-  fprintf(stderr, "set: %zu[byte]\n", malloc_size);
+  g->set_size = info.setPoolSize;
+  if (g->verbose) {
+    fprintf(stderr, "set: %zu[byte]\n", sizeof(bitset_t) * info.setPoolSize);
+  }
 
   info.strPoolSize = read16(buf, &info);
+  g->str_size = info.strPoolSize;
   if(info.strPoolSize > 0) {
-    ctx->strs = (const char **) VM_MALLOC(sizeof(const char *) * info.strPoolSize);
-    for (i = 0; i < info.strPoolSize; i++) {
-      uint16_t len = read16(buf, &info);
-      char *str = peek(buf, &info);
-      skip(&info, len + 1);
-      ctx->strs[i] = pstring_alloc(str, (unsigned)len);
-#if MININEZ_DEBUG == 1
-      fprintf(stderr, "str[%d]: '%s'\n", i, ctx->strs[i]);
-#endif
+    g->strs = (const char **) calloc(info.strPoolSize, sizeof(const char *));
+    g->memory_size += sizeof(const char *) * info.strPoolSize;
+    if (!loadStringPool(buf, &info, g->strs, info.strPoolSize, &g->memory_size)) {
+      goto truncated;
+    }
+    if (trace) {
+      for (i = 0; i < info.strPoolSize; i++) {
+        fprintf(stderr, "str[%d]: '%s'\n", i, g->strs[i]);
+      }
     }
   }
 
-#if MININEZ_DEBUG == 1
-  dumpByteCodeInfo(&info);
-#endif
+  info.tagPoolSize = read16(buf, &info);
+  g->tag_size = info.tagPoolSize;
+  if(info.tagPoolSize > 0) {
+    g->tags = (const char **) calloc(info.tagPoolSize, sizeof(const char *));
+    g->memory_size += sizeof(const char *) * info.tagPoolSize;
+    if (!loadStringPool(buf, &info, g->tags, info.tagPoolSize, &g->memory_size)) {
+      goto truncated;
+    }
+    if (trace) {
+      for (i = 0; i < info.tagPoolSize; i++) {
+        fprintf(stderr, "tag[%d]: #%s\n", i, g->tags[i]);
+      }
+    }
+  }
 
-  read16(buf, &info); // mininez doesn't use tag
   read16(buf, &info); // mininez doesn't use symbol table
+  if (info.truncated) {
+    goto truncated;
+  }
 
-  /*
-  ** head is a tmporary variable that indecates the begining
-  ** of the instruction sequence
-  */
-  head = inst = VM_MALLOC(sizeof(*inst) * (info.instSize + 2));
-  memset(inst, 0, sizeof(*inst) * (info.instSize + 2));
+  if (trace) {
+    dumpByteCodeInfo(&info);
+  }
 
   /* init bytecode loader */
-  ByteCodeLoader *loader = malloc(sizeof(ByteCodeLoader));
-  loader->input = buf;
-  loader->info = &info;
-  loader->head = head;
+  loader.input = buf;
+  loader.info = &info;
+  loader.head = NULL;
+  loader.nterms = g->nterms;
+  loader.trace = trace;
+  loader.optimize = (flags & MININEZ_LOAD_OPTIMIZE) != 0;
+  loader.inline_size = (flags >> 8) & 0x1ff
+      ? ((flags >> 8) & 0x1ff) - 1 : MININEZ_INLINE_DEFAULT;
+  loader.start_point = start_point;
+  loader.error = NULL;
 
-  loadMiniNezInstruction(head, loader, ctx);
+  g->inst = loadMiniNezInstruction(&loader, g);
+  if (g->inst == NULL) {
+    *error = loader.error;
+    mininez_DisposeGrammar(g);
+    return NULL;
+  }
+  loader.head = g->inst;
+  compressSets(g);
+  compileCharClasses(g);
 
-  fprintf(stderr, "byte code memory: %zu [byte]\n", malloc_size);
+  if (g->verbose) {
+    fprintf(stderr, "byte code memory: %zu [byte]\n", g->memory_size);
+  }
+  if (flags & MININEZ_LOAD_DIRECT) {
+    mininez_ThreadGrammar(g);
+  }
+  if (flags & MININEZ_LOAD_JIT) {
+    mininez_CompileGrammar(g);
+  }
+  return g;
 
-  return head;
+truncated:
+  *error = "bytecode error: the file ends in the middle of the grammar";
+  mininez_DisposeGrammar(g);
+  return NULL;
+}
+
+Grammar mininez_LoadGrammarFile(const char *code_file, const char *start_point,
+    int flags, const char **error) {
+  size_t code_length;
+  char *buf = loadFile(code_file, &code_length);
+  Grammar g;
+  if (buf == NULL) {
+    *error = "open error: cannot read the grammar file";
+    return NULL;
+  }
+  if (mininez_IsGrammarImage(buf, code_length)) {
+    /* used in place; the grammar keeps the mapping */
+    g = mininez_LoadGrammarImage(buf, code_length, flags, error);
+    if (g == NULL) {
+      unloadFile(buf, code_length);
+    }
+    return g;
+  }
+  g = mininez_LoadGrammar(buf, code_length, start_point, flags, error);
+  unloadFile(buf, code_length);
+  return g;
+}
+
+/* the command line tools: report errors and exit */
+Grammar loadMachineCode(const char* code_file, const char* start_point, int trace, int optimize,
+    int inline_size) {
+  const char *error = NULL;
+  int flags = MININEZ_LOAD_VERBOSE;
+  Grammar g;
+  if (trace) {
+    flags |= MININEZ_LOAD_TRACE;
+  }
+  if (optimize) {
+    flags |= MININEZ_LOAD_OPTIMIZE;
+  }
+  if (inline_size >= 0) {
+    flags |= MININEZ_LOAD_INLINE(inline_size);
+  }
+  g = mininez_LoadGrammarFile(code_file, start_point, flags, &error);
+  if (g == NULL) {
+    nez_PrintErrorInfo(error);
+  }
+  return g;
+}
+
+void mininez_DisposeGrammar(Grammar g) {
+  unsigned i;
+  if (g->image != NULL) {
+    /* the pools point into the image; only their pointer arrays are ours */
+    VM_FREE(g->nterms);
+    VM_FREE(g->strs);
+    VM_FREE(g->tags);
+    VM_FREE(g->jit_entries);
+    VM_FREE(g->threaded);
+    VM_FREE(g->threaded_tables);
+    unloadFile(g->image, g->image_size);
+    if (g->jit_code != NULL) {
+      munmap(g->jit_code, g->jit_size);
+    }
+    VM_FREE(g);
+    return;
+  }
+  /* a grammar that failed to load has NULL pools or pool entries */
+  for (i = 0; g->nterms != NULL && i < g->nterm_size && g->nterms[i] != NULL; i++) {
+    pstring_delete(g->nterms[i]);
+  }
+  for (i = 0; g->strs != NULL && i < g->str_size && g->strs[i] != NULL; i++) {
+    pstring_delete(g->strs[i]);
+  }
+  for (i = 0; g->tags != NULL && i < g->tag_size && g->tags[i] != NULL; i++) {
+    pstring_delete(g->tags[i]);
+  }
+  VM_FREE(g->nterms);
+  VM_FREE(g->sets);
+  VM_FREE(g->byte_class);
+  VM_FREE(g->class_sets);
+  VM_FREE(g->classes);
+  VM_FREE(g->strs);
+  VM_FREE(g->tags);
+  VM_FREE(g->inst);
+  VM_FREE(g->jump_tables);
+  VM_FREE(g->entries);
+  VM_FREE(g->jit_entries);
+  VM_FREE(g->threaded);
+  VM_FREE(g->threaded_tables);
+  if (g->jit_code != NULL) {
+    munmap(g->jit_code, g->jit_size);
+  }
+  VM_FREE(g);
 }
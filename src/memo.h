@@ -0,0 +1,117 @@
+/****************************************************************************
+ * Copyright (c) 2015, Masahiro Ide <imasahiro9 at gmail.com>
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ ***************************************************************************/
+
+#ifndef MEMO_H
+#define MEMO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+** Packrat memo table keyed by (nonterminal, pos).
+** The table is an elastic (direct mapped) table of window * memo_points
+** entries. An entry for pos is overwritten by pos + window, so the table
+** only remembers a sliding window of recent positions and its size does
+** not depend on the input size.
+*/
+
+#define MEMO_ENTRY_EMPTY (-1L)
+#define MEMO_FAIL        (-1L)
+
+typedef struct MemoEntry {
+    long key;      /* pos * memo_points + nterm */
+    long consumed; /* end position, or MEMO_FAIL */
+} MemoEntry;
+
+typedef struct MemoTable {
+    MemoEntry *entries;
+    size_t size;
+    size_t window;
+    unsigned memo_points;
+    size_t lookup;
+    size_t hit;
+    size_t store;
+} MemoTable;
+
+static inline void memo_reset(MemoTable *memo)
+{
+    size_t i;
+    for (i = 0; i < memo->size; i++) {
+        memo->entries[i].key = MEMO_ENTRY_EMPTY;
+    }
+    memo->lookup = 0;
+    memo->hit = 0;
+    memo->store = 0;
+}
+
+static inline MemoTable *memo_init(size_t window, unsigned memo_points)
+{
+    MemoTable *memo = (MemoTable *)malloc(sizeof(MemoTable));
+    if (memo_points == 0) {
+        memo_points = 1;
+    }
+    memo->window = window;
+    memo->memo_points = memo_points;
+    memo->size = window * memo_points;
+    memo->entries = (MemoEntry *)malloc(sizeof(MemoEntry) * memo->size);
+    memo_reset(memo);
+    return memo;
+}
+
+static inline void memo_dispose(MemoTable *memo)
+{
+    free(memo->entries);
+    free(memo);
+}
+
+static inline MemoEntry *memo_lookup(MemoTable *memo, unsigned nterm, long pos)
+{
+    long key = pos * memo->memo_points + nterm;
+    MemoEntry *e = &memo->entries[(size_t)key % memo->size];
+    memo->lookup++;
+    if (e->key == key) {
+        memo->hit++;
+        return e;
+    }
+    return NULL;
+}
+
+static inline void memo_store(MemoTable *memo, unsigned nterm, long pos, long consumed)
+{
+    long key = pos * memo->memo_points + nterm;
+    MemoEntry *e = &memo->entries[(size_t)key % memo->size];
+    e->key = key;
+    e->consumed = consumed;
+    memo->store++;
+}
+
+static inline void memo_report(MemoTable *memo, FILE *fp)
+{
+    double rate = memo->lookup ? 100.0 * memo->hit / memo->lookup : 0.0;
+    fprintf(fp, "memo: window=%zu entries=%zu[byte] lookup=%zu hit=%zu store=%zu hit_rate=%.2f%%\n",
+            memo->window, memo->size * sizeof(MemoEntry),
+            memo->lookup, memo->hit, memo->store, rate);
+}
+
+#endif /* end of include guard */
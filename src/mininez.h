@@ -0,0 +1,119 @@
+#ifndef MININEZ_H
+#define MININEZ_H
+
+#include <stddef.h>
+
+/*
+** The embedding API of libnez.
+**
+** A grammar is loaded once and is read-only from then on, so any number
+** of threads may parse with it, each through its own context. A context
+** is reused from one parse to the next; parsing does not allocate once
+** its input buffer has grown to the largest input, does not write to
+** stderr and never exits the process. No function here keeps state
+** outside the grammar and the context it is given, except
+** mininez_EnableStackGuard.
+**
+**   const char *error;
+**   MiniNezGrammar g = mininez_LoadGrammarFile("json.bin", "File",
+**       MININEZ_LOAD_OPTIMIZE | MININEZ_LOAD_JIT, &error);
+**   MiniNezContext ctx = mininez_CreateContext(g);
+**   if (mininez_Parse(ctx, text, length) == MININEZ_MATCH) ...
+**   mininez_DisposeContext(ctx);
+**   mininez_DisposeGrammar(g);
+**
+** The VM treats a NUL byte as the end of the input, so a NUL inside the
+** buffer ends the parse there (MININEZ_PARTIAL if the grammar accepted
+** the prefix).
+*/
+
+typedef struct Grammar* MiniNezGrammar;
+typedef struct Context* MiniNezContext;
+
+/* mininez_LoadGrammar flags */
+#define MININEZ_LOAD_OPTIMIZE 1 /* run the bytecode optimizer */
+#define MININEZ_LOAD_JIT      2 /* compile to native code where available */
+#define MININEZ_LOAD_VERBOSE  4 /* print load statistics to stderr */
+#define MININEZ_LOAD_TRACE    8 /* dump the bytecode to stderr */
+#define MININEZ_LOAD_DIRECT  16 /* translate to direct-threaded code */
+/*
+** With MININEZ_LOAD_OPTIMIZE, calls to productions of at most SIZE
+** instructions (0 to 254) are replaced by their body; the default is
+** MININEZ_INLINE_DEFAULT.
+*/
+#define MININEZ_LOAD_INLINE(SIZE) ((((SIZE) & 0xff) + 1) << 8)
+#define MININEZ_INLINE_DEFAULT 8
+
+/* mininez_Parse results */
+enum MiniNezStatus {
+  MININEZ_MATCH = 0,     /* the grammar matched the whole input */
+  MININEZ_NOMATCH = 1,   /* the grammar rejected the input */
+  MININEZ_PARTIAL = 2,   /* the grammar matched mininez_MatchLength bytes */
+  MININEZ_OVERFLOW = 3,  /* the backtrack stack overflowed (mininez_EnableStackGuard) */
+  MININEZ_ERROR = 4      /* out of memory */
+};
+
+/*
+** NULL on failure, with a static message in *error; files may also be
+** images. start_point names the entry points, separated by commas; with
+** MININEZ_LOAD_OPTIMIZE the code and pool entries none of them reaches
+** are dropped. NULL selects the first production of the bytecode.
+*/
+MiniNezGrammar mininez_LoadGrammar(const void *code, size_t length, const char *start_point,
+    int flags, const char **error);
+MiniNezGrammar mininez_LoadGrammarFile(const char *path, const char *start_point,
+    int flags, const char **error);
+void mininez_DisposeGrammar(MiniNezGrammar g);
+
+/*
+** Write the loaded grammar as an image, which mininez_LoadGrammarFile
+** maps read-only and uses in place instead of decoding and optimizing
+** the bytecode again; start_point and MININEZ_LOAD_OPTIMIZE are those
+** the grammar was loaded with. Images are specific to the build and the
+** machine that wrote them. Returns 0 with a message in *error.
+*/
+int mininez_SaveGrammarImage(MiniNezGrammar g, const char *path, const char **error);
+
+/* NULL if the backtrack stack cannot be reserved */
+MiniNezContext mininez_CreateContext(MiniNezGrammar g);
+void mininez_ResetContext(MiniNezContext ctx);
+void mininez_DisposeContext(MiniNezContext ctx);
+
+/*
+** The backtrack stack ends in a guard page, and a parse that overflows it
+** faults there with SIGSEGV, which by default ends the process. After
+** mininez_EnableStackGuard, parses of the context return
+** MININEZ_OVERFLOW instead. This takes over SIGSEGV and SIGBUS for the
+** whole process: the first call installs a handler for both with
+** sigaction, once, and never removes it. A fault outside the guard pages
+** of the contexts is passed on to the handler that was installed before,
+** or takes the default action, so a host that installs its own handlers
+** afterwards must chain to the previous ones in the same way. Each thread
+** keeps the context it is parsing with in a thread-local variable.
+*/
+void mininez_EnableStackGuard(MiniNezContext ctx);
+
+/* the buffer is copied; it need not be NUL terminated */
+int mininez_Parse(MiniNezContext ctx, const char *input, size_t length);
+size_t mininez_MatchLength(MiniNezContext ctx);
+
+/*
+** Incremental reparsing. After mininez_EnableReparse, parses keep the
+** result of every nonterminal call with the span of input it examined.
+** mininez_Edit replaces removed bytes at start of the input of the last
+** parse with inserted bytes of text and drops the results that examined
+** them, and mininez_Reparse parses the edited input again, rerunning only
+** the calls whose results were dropped. The results take 16 bytes per
+** call of the parse; inputs over 4 GB are parsed in full. The first two
+** return 0 when out of memory, mininez_Edit also for a range outside the
+** input; mininez_Reparse returns as mininez_Parse.
+*/
+int mininez_EnableReparse(MiniNezContext ctx);
+int mininez_Edit(MiniNezContext ctx, size_t start, size_t removed,
+    const char *text, size_t inserted);
+int mininez_Reparse(MiniNezContext ctx);
+
+/* parse from another entry point of the grammar; 0 if nterm is not one */
+int mininez_SetEntryPoint(MiniNezContext ctx, const char *nterm);
+
+#endif /* end of include guard */
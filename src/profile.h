@@ -0,0 +1,299 @@
+/****************************************************************************
+ * Copyright (c) 2015, Masahiro Ide <imasahiro9 at gmail.com>
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ ***************************************************************************/
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/*
+** Per-nonterminal profile, filled by the profiling VM loop.
+** Icall opens a frame that remembers the backtrack stack top at the call.
+** A return pops the stack below that mark and closes the frame as a
+** success; a failure that unwinds the stack below it closes the frame as
+** failed. The bytes a failure gives back (its position less the position
+** of the alt frame it returns to) are charged to the nonterminal whose
+** frame is still open, the one whose choice is going to read them again;
+** the entry after the last nonterminal stands for the start rule. Cost
+** is counted in dispatched instructions and in nanoseconds; a recursive
+** nonterminal adds its inclusive cost and its bytes once, at the
+** outermost call. The frames also walk a calling-context tree whose
+** exclusive instruction counts are written out as folded stacks.
+*/
+
+#define PROFILE_ROOT 0
+
+typedef struct ProfileEntry {
+    size_t calls;
+    size_t failed;
+    size_t consumed;  /* bytes consumed by the successful calls */
+    size_t rescanned; /* bytes given back by its backtracks */
+    uint64_t inclusive_inst;
+    uint64_t exclusive_inst;
+    uint64_t inclusive_ns;
+    uint64_t exclusive_ns;
+    unsigned active;  /* open calls, for recursion */
+} ProfileEntry;
+
+typedef struct ProfileNode {
+    unsigned nterm;
+    unsigned parent;
+    unsigned child;   /* first child, PROFILE_ROOT for none */
+    unsigned sibling;
+    uint64_t exclusive_inst;
+} ProfileNode;
+
+typedef struct ProfileFrame {
+    const char *mark; /* backtrack stack top before the call */
+    unsigned nterm;
+    unsigned node;
+    long pos;
+    uint64_t inst;
+    uint64_t ns;
+    uint64_t child_inst;
+    uint64_t child_ns;
+} ProfileFrame;
+
+typedef struct Profile {
+    ProfileEntry *entries;
+    unsigned nterm_size;
+    ProfileNode *nodes;
+    unsigned node_size;
+    unsigned node_capacity;
+    ProfileFrame *frames;
+    unsigned frame_size;
+    unsigned frame_capacity;
+    uint64_t total_inst;
+    uint64_t total_ns;
+} Profile;
+
+static inline uint64_t profile_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void profile_reset(Profile *prof)
+{
+    memset(prof->entries, 0, sizeof(ProfileEntry) * prof->nterm_size);
+    memset(&prof->nodes[PROFILE_ROOT], 0, sizeof(ProfileNode));
+    prof->nodes[PROFILE_ROOT].nterm = prof->nterm_size;
+    prof->node_size = 1;
+    prof->frame_size = 0;
+    prof->total_inst = 0;
+    prof->total_ns = 0;
+}
+
+static inline Profile *profile_init(unsigned nterm_size)
+{
+    Profile *prof = (Profile *)malloc(sizeof(Profile));
+    prof->nterm_size = nterm_size;
+    prof->entries = (ProfileEntry *)malloc(sizeof(ProfileEntry) * (nterm_size + 1));
+    prof->node_capacity = 64;
+    prof->nodes = (ProfileNode *)malloc(sizeof(ProfileNode) * prof->node_capacity);
+    prof->frame_capacity = 64;
+    prof->frames = (ProfileFrame *)malloc(sizeof(ProfileFrame) * prof->frame_capacity);
+    profile_reset(prof);
+    return prof;
+}
+
+static inline void profile_dispose(Profile *prof)
+{
+    free(prof->entries);
+    free(prof->nodes);
+    free(prof->frames);
+    free(prof);
+}
+
+static inline unsigned profile_child(Profile *prof, unsigned parent, unsigned nterm)
+{
+    unsigned node = prof->nodes[parent].child;
+    while (node != PROFILE_ROOT) {
+        if (prof->nodes[node].nterm == nterm) {
+            return node;
+        }
+        node = prof->nodes[node].sibling;
+    }
+    if (prof->node_size == prof->node_capacity) {
+        prof->node_capacity *= 2;
+        prof->nodes = (ProfileNode *)realloc(prof->nodes, sizeof(ProfileNode) * prof->node_capacity);
+    }
+    node = prof->node_size++;
+    prof->nodes[node].nterm = nterm;
+    prof->nodes[node].parent = parent;
+    prof->nodes[node].child = PROFILE_ROOT;
+    prof->nodes[node].sibling = prof->nodes[parent].child;
+    prof->nodes[node].exclusive_inst = 0;
+    prof->nodes[parent].child = node;
+    return node;
+}
+
+static inline void profile_enter(Profile *prof, unsigned nterm, const void *mark, long pos, uint64_t inst)
+{
+    ProfileFrame *f;
+    unsigned parent = prof->frame_size ? prof->frames[prof->frame_size - 1].node : PROFILE_ROOT;
+    if (prof->frame_size == prof->frame_capacity) {
+        prof->frame_capacity *= 2;
+        prof->frames = (ProfileFrame *)realloc(prof->frames, sizeof(ProfileFrame) * prof->frame_capacity);
+    }
+    f = &prof->frames[prof->frame_size++];
+    f->mark = (const char *)mark;
+    f->nterm = nterm;
+    f->node = profile_child(prof, parent, nterm);
+    f->pos = pos;
+    f->inst = inst;
+    f->child_inst = 0;
+    f->child_ns = 0;
+    prof->entries[nterm].calls++;
+    prof->entries[nterm].active++;
+    f->ns = profile_clock();
+}
+
+/* close the frames whose call is below the stack top mark */
+static inline void profile_leave(Profile *prof, const void *mark, long pos, uint64_t inst, int failed)
+{
+    uint64_t now = 0;
+    while (prof->frame_size > 0
+            && prof->frames[prof->frame_size - 1].mark >= (const char *)mark) {
+        ProfileFrame *f = &prof->frames[--prof->frame_size];
+        ProfileEntry *e = &prof->entries[f->nterm];
+        uint64_t inst_incl = inst - f->inst;
+        uint64_t ns_incl;
+        if (now == 0) {
+            now = profile_clock();
+        }
+        ns_incl = now - f->ns;
+        e->exclusive_inst += inst_incl - f->child_inst;
+        e->exclusive_ns += ns_incl - f->child_ns;
+        prof->nodes[f->node].exclusive_inst += inst_incl - f->child_inst;
+        if (failed) {
+            e->failed++;
+        }
+        if (--e->active == 0) {
+            e->inclusive_inst += inst_incl;
+            e->inclusive_ns += ns_incl;
+            if (!failed) {
+                e->consumed += (size_t)(pos - f->pos);
+            }
+        }
+        if (prof->frame_size > 0) {
+            prof->frames[prof->frame_size - 1].child_inst += inst_incl;
+            prof->frames[prof->frame_size - 1].child_ns += ns_incl;
+        }
+    }
+}
+
+/* a failure at pos unwinds to the alt frame at mark, which resumes at back */
+static inline void profile_backtrack(Profile *prof, const void *mark, long pos, long back, uint64_t inst)
+{
+    unsigned owner = prof->nterm_size;
+    profile_leave(prof, mark, pos, inst, 1);
+    if (prof->frame_size > 0) {
+        owner = prof->frames[prof->frame_size - 1].nterm;
+    }
+    prof->entries[owner].rescanned += pos > back ? (size_t)(pos - back) : 0;
+}
+
+/* after a parse of inst instructions: whatever no call covers goes to the root */
+static inline void profile_finish(Profile *prof, uint64_t inst, uint64_t ns)
+{
+    uint64_t called = 0;
+    unsigned node;
+    prof->total_inst += inst;
+    prof->total_ns += ns;
+    for (node = 1; node < prof->node_size; node++) {
+        called += prof->nodes[node].exclusive_inst;
+    }
+    prof->nodes[PROFILE_ROOT].exclusive_inst = prof->total_inst > called ? prof->total_inst - called : 0;
+}
+
+typedef struct ProfileRank {
+    unsigned nterm;
+    uint64_t key;
+} ProfileRank;
+
+static inline int profile_compare(const void *a, const void *b)
+{
+    uint64_t x = ((const ProfileRank *)a)->key;
+    uint64_t y = ((const ProfileRank *)b)->key;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/* nonterminals by exclusive instructions, most expensive first */
+static inline void profile_report(Profile *prof, const char **nterms, FILE *fp)
+{
+    ProfileRank *rank = (ProfileRank *)malloc(sizeof(ProfileRank) * (prof->nterm_size + 1));
+    unsigned i, size = 0;
+    double total = prof->total_inst ? (double)prof->total_inst : 1.0;
+    for (i = 0; i <= prof->nterm_size; i++) {
+        if (prof->entries[i].calls > 0 || prof->entries[i].rescanned > 0) {
+            rank[size].nterm = i;
+            rank[size].key = prof->entries[i].exclusive_inst;
+            size++;
+        }
+    }
+    qsort(rank, size, sizeof(ProfileRank), profile_compare);
+    fprintf(fp, "profile: %llu instructions, %.3f msec\n",
+            (unsigned long long)prof->total_inst, prof->total_ns / 1e6);
+    fprintf(fp, "%-24s %10s %10s %12s %12s %14s %14s %6s %10s %10s\n",
+            "nonterminal", "calls", "failed", "consumed", "rescanned",
+            "incl_inst", "excl_inst", "excl%", "incl_ms", "excl_ms");
+    for (i = 0; i < size; i++) {
+        ProfileEntry *e = &prof->entries[rank[i].nterm];
+        fprintf(fp, "%-24s %10zu %10zu %12zu %12zu %14llu %14llu %5.1f%% %10.3f %10.3f\n",
+                rank[i].nterm < prof->nterm_size ? nterms[rank[i].nterm] : "(start)", e->calls, e->failed, e->consumed, e->rescanned,
+                (unsigned long long)e->inclusive_inst, (unsigned long long)e->exclusive_inst,
+                100.0 * e->exclusive_inst / total, e->inclusive_ns / 1e6, e->exclusive_ns / 1e6);
+    }
+    free(rank);
+}
+
+static inline void profile_print_path(Profile *prof, const char **nterms, unsigned node, FILE *fp)
+{
+    if (node == PROFILE_ROOT) {
+        fputs("(start)", fp);
+        return;
+    }
+    profile_print_path(prof, nterms, prof->nodes[node].parent, fp);
+    fprintf(fp, ";%s", nterms[prof->nodes[node].nterm]);
+}
+
+/* "(start);A;B <instructions>" per calling context, for flame graph tools */
+static inline void profile_dump_folded(Profile *prof, const char **nterms, FILE *fp)
+{
+    unsigned node;
+    for (node = PROFILE_ROOT; node < prof->node_size; node++) {
+        if (prof->nodes[node].exclusive_inst > 0) {
+            profile_print_path(prof, nterms, node, fp);
+            fprintf(fp, " %llu\n", (unsigned long long)prof->nodes[node].exclusive_inst);
+        }
+    }
+}
+
+#endif /* end of include guard */
@@ -30,7 +30,10 @@
 #include <stdint.h>
 #include <assert.h>
 #include <stdlib.h>
+#if defined(__x86_64__)
+#define PSTRING_USE_SIMD 1
 #include <x86intrin.h>
+#endif
 
 #ifndef OFFSET_OF
 #define OFFSET_OF(TYPE, FIELD) ((unsigned long)&(((TYPE *)0)->FIELD))
@@ -40,9 +43,25 @@
 #define CONTAINER_OF(PTR, TYPE, FIELD) ((TYPE *)((char *)(PTR) - OFFSET_OF(TYPE, FIELD)))
 #endif
 
+#ifndef VM_MALLOC
+#define VM_MALLOC(N) malloc(N)
+#endif
+
+#ifndef VM_FREE
+#define VM_FREE(P) free(P)
+#endif
+
 #define PSTRING_PTR(STR) ((STR)->str)
 // #define PSTRING_USE_STRCMP 1
 
+/*
+** Padding contract: a pstring is followed by at least PSTRING_PADDING
+** zero bytes, and so is every input the VM matches against (see
+** MININEZ_INPUT_PADDING). The compare kernels rely on it to load whole
+** vectors from both sides without testing the length first.
+*/
+#define PSTRING_PADDING 64
+
 typedef struct pstring_t {
     unsigned len;
     char str[1];
@@ -50,17 +69,18 @@ typedef struct pstring_t {
 
 static inline const char *pstring_alloc(const char *t, unsigned len)
 {
-    pstring_t *str = (pstring_t *) VM_MALLOC(sizeof(pstring_t) + len + 1);
+    pstring_t *str = (pstring_t *) VM_MALLOC(sizeof(pstring_t) + len + PSTRING_PADDING);
     str->len = len;
     memcpy(PSTRING_PTR(str), t, len);
-    str->str[len] = 0;
+    memset(str->str + len, 0, PSTRING_PADDING);
     return PSTRING_PTR(str);
 }
 
 static inline const char *pstring_alloc2(unsigned len)
 {
-    pstring_t *str = (pstring_t *) VM_MALLOC(sizeof(pstring_t) + len + 1);
+    pstring_t *str = (pstring_t *) VM_MALLOC(sizeof(pstring_t) + len + PSTRING_PADDING);
     str->len = len;
+    memset(str->str + len, 0, PSTRING_PADDING);
     return PSTRING_PTR(str);
 }
 
@@ -94,35 +114,124 @@ static inline int pstring_starts_with_simple(const char *p, const char *text, un
     return 1;
 }
 
-#ifdef __AVX2__
+/*
+** Vector compare kernels. Literals of up to 8 bytes take one masked
+** 64-bit compare, and up to 32 bytes the SSE2 kernel; both are inlined,
+** since SSE2 is part of x86-64. Longer literals go to the widest kernel
+** the CPU has, chosen once at startup. A kernel stops at the first
+** chunk with a mismatch. The input always mismatches at its NUL
+** sentinel, so no load starts past it, and the padding covers the rest
+** of that load.
+*/
+enum pstring_kernel {
+    PSTRING_SCALAR,
+    PSTRING_SSE2,
+    PSTRING_AVX2
+};
+
+#ifdef PSTRING_USE_SIMD
+/* one 8-byte compare under a mask; short literals are the common case */
+static inline int pstring_starts_with_word(const char *str, const char *text, unsigned len)
+{
+    uint64_t s, t, mask;
+    memcpy(&s, str, 8);
+    memcpy(&t, text, 8);
+    mask = len == 8 ? ~(uint64_t)0 : (((uint64_t)1 << (len * 8)) - 1);
+    return ((s ^ t) & mask) == 0;
+}
+
+static inline int pstring_starts_with_sse2(const char *str, const char *text, unsigned len)
+{
+    unsigned m, mask;
+    while (len >= 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)str);
+        __m128i t = _mm_loadu_si128((const __m128i *)text);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, t)) != 0xffff) {
+            return 0;
+        }
+        str += 16;
+        text += 16;
+        len -= 16;
+    }
+    if (len == 0) {
+        return 1;
+    }
+    m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)str),
+                                         _mm_loadu_si128((const __m128i *)text)));
+    mask = (1U << len) - 1;
+    return (m & mask) == mask;
+}
+
+__attribute__((target("avx2")))
 static inline int pstring_starts_with_avx2(const char *str, const char *text, unsigned len)
 {
     uint64_t m, mask;
-    __m256i s = _mm256_loadu_si256((const __m256i *)str);
-    __m256i t = _mm256_loadu_si256((const __m256i *)text);
-    assert(len <= 32);
-    s = _mm256_cmpeq_epi8(s, t);
-    m = _mm256_movemask_epi8(s);
+    while (len >= 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)str);
+        __m256i t = _mm256_loadu_si256((const __m256i *)text);
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, t)) != 0xffffffffU) {
+            return 0;
+        }
+        str += 32;
+        text += 32;
+        len -= 32;
+    }
+    if (len == 0) {
+        return 1;
+    }
+    m = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)str),
+                                                         _mm256_loadu_si256((const __m256i *)text)));
     mask = ((uint64_t)1 << len) - 1;
-    return ((m & mask) == mask);
+    return (m & mask) == mask;
 }
+
 #endif
 
-static inline int pstring_starts_with(const char *str, const char *text, unsigned len)
+static inline int pstring_select_kernel(void)
 {
-#ifdef __AVX2__
-    if (len <= 32) {
-        return pstring_starts_with_avx2(str, text, len);
+#ifdef PSTRING_USE_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return PSTRING_AVX2;
     }
-    else
+    return PSTRING_SSE2;
+#else
+    return PSTRING_SCALAR;
+#endif
+}
+
+/* pstring_select_kernel(), set once before main; defined in vm.c */
+extern int pstring_kernel;
+
+static inline int pstring_starts_with_kernel(int kernel, const char *str, const char *text, unsigned len)
+{
+    switch (kernel) {
+#ifdef PSTRING_USE_SIMD
+    case PSTRING_AVX2:
+        return pstring_starts_with_avx2(str, text, len);
+    case PSTRING_SSE2:
+        return pstring_starts_with_sse2(str, text, len);
 #endif
-    {
+    default:
+        return pstring_starts_with_simple(str, text, len);
+    }
+}
+
+static inline int pstring_starts_with(const char *str, const char *text, unsigned len)
+{
 #if defined(PSTRING_USE_STRCMP)
-        return pstring_starts_with_strcmp(str, text, len);
+    return pstring_starts_with_strcmp(str, text, len);
+#elif defined(PSTRING_USE_SIMD)
+    if (len <= 8) {
+        return pstring_starts_with_word(str, text, len);
+    }
+    if (len <= 32) {
+        return pstring_starts_with_sse2(str, text, len);
+    }
+    return pstring_starts_with_kernel(pstring_kernel, str, text, len);
 #else
-        return pstring_starts_with_simple(str, text, len);
+    return pstring_starts_with_simple(str, text, len);
 #endif
-    }
 }
 
 #if 0
@@ -172,12 +281,161 @@ static inline const char *pstring_find_not_char(const char *str, const char *end
             }
 #undef MODE
             str += 16;
+            rest -= 16;
         } while (rest != 0);
     }
 #endif
-    while (*str == c) {
+    while (str < end && *str == c) {
         str++;
     }
     return str;
 }
+
+/*
+** Scan kernels: the first position at or after str where c (or text)
+** starts, or the NUL sentinel, whichever comes first. They load whole
+** vectors under the padding contract and stop at the vector holding
+** the NUL.
+*/
+static inline const char *pstring_scan_byte_simple(const char *str, uint8_t c)
+{
+    while ((uint8_t)*str != c && *str != 0) {
+        str++;
+    }
+    return str;
+}
+
+#ifdef PSTRING_USE_SIMD
+static inline const char *pstring_scan_byte_sse2(const char *str, uint8_t c)
+{
+    const __m128i needle = _mm_set1_epi8((char)c);
+    const __m128i zero = _mm_setzero_si128();
+    while (1) {
+        __m128i v = _mm_loadu_si128((const __m128i *)str);
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, needle),
+                                                              _mm_cmpeq_epi8(v, zero)));
+        if (m != 0) {
+            return str + __builtin_ctz(m);
+        }
+        str += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline const char *pstring_scan_byte_avx2(const char *str, uint8_t c)
+{
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    const __m256i zero = _mm256_setzero_si256();
+    while (1) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)str);
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, needle),
+                                                                    _mm256_cmpeq_epi8(v, zero)));
+        if (m != 0) {
+            return str + __builtin_ctz(m);
+        }
+        str += 32;
+    }
+}
+#endif
+
+static inline const char *pstring_scan_byte(const char *str, uint8_t c)
+{
+#ifdef PSTRING_USE_SIMD
+    if (pstring_kernel == PSTRING_AVX2) {
+        return pstring_scan_byte_avx2(str, c);
+    }
+    return pstring_scan_byte_sse2(str, c);
+#else
+    return pstring_scan_byte_simple(str, c);
+#endif
+}
+
+/*
+** A candidate needs the first byte of text at i and, for texts of up to
+** PSTRING_SCAN_PAIR_MAX bytes, its last byte at i + len - 1, so "*" in
+** the body of a comment rarely stops the scan for "*" "/". The second
+** load reaches len - 1 bytes further, which the padding still covers.
+*/
+#define PSTRING_SCAN_PAIR_MAX 32
+
+static inline const char *pstring_scan_str_simple(const char *str, const char *text, unsigned len)
+{
+    while (*str != 0 && !pstring_starts_with_simple(str, text, len)) {
+        str++;
+    }
+    return str;
+}
+
+#ifdef PSTRING_USE_SIMD
+static inline const char *pstring_scan_str_sse2(const char *str, const char *text, unsigned len)
+{
+    unsigned shift = len <= PSTRING_SCAN_PAIR_MAX ? len - 1 : 0;
+    const __m128i first = _mm_set1_epi8(text[0]);
+    const __m128i last = _mm_set1_epi8(text[shift]);
+    const __m128i zero = _mm_setzero_si128();
+    while (1) {
+        __m128i a = _mm_loadu_si128((const __m128i *)str);
+        __m128i b = _mm_loadu_si128((const __m128i *)(str + shift));
+        unsigned end = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(a, zero));
+        unsigned m = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                               _mm_cmpeq_epi8(b, last)));
+        /* candidates up to the NUL */
+        m &= end != 0 ? (end ^ (end - 1)) : ~0U;
+        while (m != 0) {
+            unsigned i = __builtin_ctz(m);
+            if (str[i] == 0 || pstring_starts_with(str + i, text, len)) {
+                return str + i;
+            }
+            m &= m - 1;
+        }
+        if (end != 0) {
+            return str + __builtin_ctz(end);
+        }
+        str += 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static inline const char *pstring_scan_str_avx2(const char *str, const char *text, unsigned len)
+{
+    unsigned shift = len <= PSTRING_SCAN_PAIR_MAX ? len - 1 : 0;
+    const __m256i first = _mm256_set1_epi8(text[0]);
+    const __m256i last = _mm256_set1_epi8(text[shift]);
+    const __m256i zero = _mm256_setzero_si256();
+    while (1) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)str);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(str + shift));
+        unsigned end = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero));
+        unsigned m = (unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                                                                     _mm256_cmpeq_epi8(b, last)));
+        m &= end != 0 ? (end ^ (end - 1)) : ~0U;
+        while (m != 0) {
+            unsigned i = __builtin_ctz(m);
+            if (str[i] == 0 || pstring_starts_with(str + i, text, len)) {
+                return str + i;
+            }
+            m &= m - 1;
+        }
+        if (end != 0) {
+            return str + __builtin_ctz(end);
+        }
+        str += 32;
+    }
+}
+#endif
+
+static inline const char *pstring_scan_str(const char *str, const char *text, unsigned len)
+{
+    if (len == 0) {
+        return str;
+    }
+#ifdef PSTRING_USE_SIMD
+    if (pstring_kernel == PSTRING_AVX2) {
+        return pstring_scan_str_avx2(str, text, len);
+    }
+    return pstring_scan_str_sse2(str, text, len);
+#else
+    return pstring_scan_str_simple(str, text, len);
+#endif
+}
 #endif /* end of include guard */
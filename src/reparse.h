@@ -0,0 +1,323 @@
+/****************************************************************************
+ * Copyright (c) 2015, Masahiro Ide <imasahiro9 at gmail.com>
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *  * Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ ***************************************************************************/
+
+#ifndef REPARSE_H
+#define REPARSE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+** Results of the nonterminal calls kept across edits of the input, for
+** incremental reparsing. An entry records the bytes a call at a position
+** consumed (or REPARSE_FAIL) and the bytes it examined from there,
+** lookahead included: the result holds as long as none of those changes,
+** wherever the edits move the position.
+**
+** The entries of a position are a list off its column, and the columns
+** live in a gap buffer: an edit moves the gap there and drops or inserts
+** columns at it, and the columns after it shift without being touched.
+** The entries that examined a replaced byte from before the edit are
+** found by scanning back REPARSE_SHORT_SPAN columns, and those examining
+** more than that in a list of their own with absolute positions. Work per
+** edit is thus bounded by the edit, the gap travel and the long entries,
+** not by the document.
+*/
+
+#define REPARSE_NONE 0U          /* the end of a list; entries[0] is unused */
+#define REPARSE_FAIL UINT32_MAX  /* consumed of a failed call */
+#define REPARSE_SHORT_SPAN 1024
+#define REPARSE_GAP 4096         /* columns the gap grows by beyond an edit */
+
+typedef struct ReparseEntry {
+    uint32_t nterm;
+    uint32_t next;     /* the next entry of the column, or of the free list */
+    uint32_t consumed; /* bytes, or REPARSE_FAIL */
+    uint32_t examined; /* bytes, from the column on */
+} ReparseEntry;
+
+typedef struct ReparseLong {
+    size_t pos;
+    uint32_t entry;
+} ReparseLong;
+
+typedef struct ReparseTable {
+    /* gap buffer of list heads, one column per position of the input */
+    uint32_t *columns;
+    size_t column_capacity;
+    size_t gap_start;
+    size_t gap_end;
+    ReparseEntry *entries;
+    uint32_t entry_size;
+    uint32_t entry_capacity;
+    uint32_t free_list;
+    /* the entries that examined more than REPARSE_SHORT_SPAN bytes */
+    ReparseLong *longs;
+    size_t long_size;
+    size_t long_capacity;
+    /* the bytes an instruction examines past pos, at least 1 */
+    unsigned lookahead;
+    size_t lookup;
+    size_t hit;
+    size_t store;
+    size_t invalidate;
+} ReparseTable;
+
+static inline size_t reparse_column_size(ReparseTable *t)
+{
+    return t->column_capacity - (t->gap_end - t->gap_start);
+}
+
+static inline uint32_t *reparse_column(ReparseTable *t, size_t pos)
+{
+    return &t->columns[pos < t->gap_start ? pos : pos + (t->gap_end - t->gap_start)];
+}
+
+/* forget every entry; the table then has a column for every position up to length */
+static inline int reparse_reset(ReparseTable *t, size_t length)
+{
+    size_t capacity = length + 1 + REPARSE_GAP;
+    if (t->column_capacity < capacity) {
+        uint32_t *columns = (uint32_t *)realloc(t->columns, sizeof(uint32_t) * capacity);
+        if (columns == NULL) {
+            return 0;
+        }
+        t->columns = columns;
+        t->column_capacity = capacity;
+    }
+    memset(t->columns, 0, sizeof(uint32_t) * (length + 1));
+    t->gap_start = length + 1;
+    t->gap_end = t->column_capacity;
+    t->entry_size = 1;
+    t->free_list = REPARSE_NONE;
+    t->long_size = 0;
+    t->lookup = 0;
+    t->hit = 0;
+    t->store = 0;
+    t->invalidate = 0;
+    return 1;
+}
+
+static inline ReparseTable *reparse_init(unsigned lookahead)
+{
+    ReparseTable *t = (ReparseTable *)calloc(1, sizeof(ReparseTable));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->lookahead = lookahead > 0 ? lookahead : 1;
+    t->entry_capacity = 1024;
+    t->entries = (ReparseEntry *)malloc(sizeof(ReparseEntry) * t->entry_capacity);
+    if (t->entries == NULL || !reparse_reset(t, 0)) {
+        free(t->entries);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static inline void reparse_dispose(ReparseTable *t)
+{
+    free(t->columns);
+    free(t->entries);
+    free(t->longs);
+    free(t);
+}
+
+static inline ReparseEntry *reparse_lookup(ReparseTable *t, unsigned nterm, long pos)
+{
+    uint32_t i;
+    t->lookup++;
+    if ((size_t)pos >= reparse_column_size(t)) {
+        return NULL;
+    }
+    for (i = *reparse_column(t, (size_t)pos); i != REPARSE_NONE; i = t->entries[i].next) {
+        if (t->entries[i].nterm == nterm) {
+            t->hit++;
+            return &t->entries[i];
+        }
+    }
+    return NULL;
+}
+
+/* a store that does not fit is dropped, which only costs a rerun */
+static inline void reparse_store(ReparseTable *t, unsigned nterm, long pos,
+        uint32_t consumed, size_t examined)
+{
+    uint32_t *column;
+    uint32_t i;
+    if ((size_t)pos >= reparse_column_size(t) || examined >= UINT32_MAX) {
+        return;
+    }
+    if (examined > REPARSE_SHORT_SPAN && t->long_size == t->long_capacity) {
+        size_t capacity = t->long_capacity ? t->long_capacity * 2 : 256;
+        ReparseLong *longs = (ReparseLong *)realloc(t->longs, sizeof(ReparseLong) * capacity);
+        if (longs == NULL) {
+            return;
+        }
+        t->longs = longs;
+        t->long_capacity = capacity;
+    }
+    if (t->free_list != REPARSE_NONE) {
+        i = t->free_list;
+        t->free_list = t->entries[i].next;
+    } else {
+        if (t->entry_size == t->entry_capacity) {
+            ReparseEntry *entries;
+            if (t->entry_capacity > UINT32_MAX / 2) {
+                return;
+            }
+            entries = (ReparseEntry *)realloc(t->entries,
+                    sizeof(ReparseEntry) * t->entry_capacity * 2);
+            if (entries == NULL) {
+                return;
+            }
+            t->entries = entries;
+            t->entry_capacity *= 2;
+        }
+        i = t->entry_size++;
+    }
+    column = reparse_column(t, (size_t)pos);
+    t->entries[i].nterm = nterm;
+    t->entries[i].consumed = consumed;
+    t->entries[i].examined = (uint32_t)examined;
+    t->entries[i].next = *column;
+    *column = i;
+    if (examined > REPARSE_SHORT_SPAN) {
+        t->longs[t->long_size].pos = (size_t)pos;
+        t->longs[t->long_size].entry = i;
+        t->long_size++;
+    }
+    t->store++;
+}
+
+static inline void reparse_free(ReparseTable *t, uint32_t i)
+{
+    t->entries[i].next = t->free_list;
+    t->free_list = i;
+    t->invalidate++;
+}
+
+static inline void reparse_unlink(ReparseTable *t, size_t pos, uint32_t entry)
+{
+    uint32_t *link = reparse_column(t, pos);
+    while (*link != entry) {
+        link = &t->entries[*link].next;
+    }
+    *link = t->entries[entry].next;
+    reparse_free(t, entry);
+}
+
+static inline void reparse_move_gap(ReparseTable *t, size_t pos)
+{
+    if (pos < t->gap_start) {
+        size_t n = t->gap_start - pos;
+        memmove(t->columns + t->gap_end - n, t->columns + pos, sizeof(uint32_t) * n);
+        t->gap_start -= n;
+        t->gap_end -= n;
+    } else if (pos > t->gap_start) {
+        size_t n = pos - t->gap_start;
+        memmove(t->columns + t->gap_start, t->columns + t->gap_end, sizeof(uint32_t) * n);
+        t->gap_start += n;
+        t->gap_end += n;
+    }
+}
+
+/*
+** The bytes [start, start + removed) of the input were replaced by
+** inserted bytes. 0 if the table cannot grow, after which it must be
+** reset.
+*/
+static inline int reparse_edit(ReparseTable *t, size_t start, size_t removed, size_t inserted)
+{
+    size_t end = start + removed;
+    size_t pos, i, kept = 0;
+    for (i = 0; i < t->long_size; i++) {
+        ReparseLong l = t->longs[i];
+        if (l.pos >= end) {
+            l.pos = l.pos - removed + inserted;
+        } else if (l.pos >= start) {
+            /* dropped with its column below */
+            continue;
+        } else if (l.pos + t->entries[l.entry].examined > start) {
+            reparse_unlink(t, l.pos, l.entry);
+            continue;
+        }
+        t->longs[kept++] = l;
+    }
+    t->long_size = kept;
+    for (pos = start > REPARSE_SHORT_SPAN ? start - REPARSE_SHORT_SPAN : 0; pos < start; pos++) {
+        uint32_t *link = reparse_column(t, pos);
+        while (*link != REPARSE_NONE) {
+            ReparseEntry *e = &t->entries[*link];
+            if (e->examined <= REPARSE_SHORT_SPAN && pos + e->examined > start) {
+                uint32_t dropped = *link;
+                *link = e->next;
+                reparse_free(t, dropped);
+            } else {
+                link = &e->next;
+            }
+        }
+    }
+    reparse_move_gap(t, start);
+    for (pos = 0; pos < removed; pos++) {
+        uint32_t e = t->columns[t->gap_end + pos];
+        while (e != REPARSE_NONE) {
+            uint32_t next = t->entries[e].next;
+            reparse_free(t, e);
+            e = next;
+        }
+    }
+    t->gap_end += removed;
+    if (t->gap_end - t->gap_start < inserted) {
+        size_t tail = t->column_capacity - t->gap_end;
+        size_t capacity = t->column_capacity * 2;
+        uint32_t *columns;
+        if (capacity < reparse_column_size(t) + inserted + REPARSE_GAP) {
+            capacity = reparse_column_size(t) + inserted + REPARSE_GAP;
+        }
+        columns = (uint32_t *)realloc(t->columns, sizeof(uint32_t) * capacity);
+        if (columns == NULL) {
+            return 0;
+        }
+        memmove(columns + capacity - tail, columns + t->gap_end, sizeof(uint32_t) * tail);
+        t->columns = columns;
+        t->column_capacity = capacity;
+        t->gap_end = capacity - tail;
+    }
+    memset(t->columns + t->gap_start, 0, sizeof(uint32_t) * inserted);
+    t->gap_start += inserted;
+    return 1;
+}
+
+static inline void reparse_report(ReparseTable *t, FILE *fp)
+{
+    double rate = t->lookup ? 100.0 * t->hit / t->lookup : 0.0;
+    fprintf(fp, "reparse: entries=%zu[byte] long=%zu lookup=%zu hit=%zu store=%zu invalidate=%zu hit_rate=%.2f%%\n",
+            (size_t)t->entry_capacity * sizeof(ReparseEntry), t->long_size,
+            t->lookup, t->hit, t->store, t->invalidate, rate);
+}
+
+#endif /* end of include guard */
@@ -1,115 +1,274 @@
 #include <stdlib.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h> // gettimeofday
 
 #include "vm.h"
 
 char *loadFile(const char *filename, size_t *length);
+void unloadFile(char *source, size_t length);
+
+int pstring_kernel = PSTRING_SCALAR;
+
+__attribute__((constructor))
+static void pstring_init_kernel(void) {
+  pstring_kernel = pstring_select_kernel();
+}
 
 void nez_PrintErrorInfo(const char *errmsg) {
   fprintf(stderr, "%s\n", errmsg);
   exit(EXIT_FAILURE);
 }
 
-Context mininez_CreateContext(const char *filename) {
+/*
+** The backtrack stack is a reserved virtual region followed by a
+** PROT_NONE guard page. The kernel commits the region page by page as the
+** stack grows, so push_* need no bounds check. A push that runs into the
+** guard page raises SIGSEGV. With mininez_EnableStackGuard, a handler
+** unwinds the running parse with siglongjmp; the handler and the thread's
+** running Context are then the only process-wide state, and a fault that
+** is not ours goes on to the handler the host program had installed.
+** Without it, nothing is installed and the fault takes its default
+** action.
+*/
+static __thread Context mininez_running_ctx = NULL;
+static struct sigaction mininez_previous_segv;
+static struct sigaction mininez_previous_bus;
+
+static void mininez_StackOverflowHandler(int sig, siginfo_t *info, void *uctx) {
+  Context ctx = mininez_running_ctx;
+  char *addr = (char *)info->si_addr;
+  struct sigaction *previous;
+  if (ctx != NULL && ctx->stack_guard <= addr
+      && addr < ctx->stack_guard + ctx->stack_guard_size) {
+    siglongjmp(ctx->stack_overflow, 1);
+  }
+  previous = sig == SIGBUS ? &mininez_previous_bus : &mininez_previous_segv;
+  if (previous->sa_flags & SA_SIGINFO) {
+    previous->sa_sigaction(sig, info, uctx);
+  } else if (previous->sa_handler != SIG_DFL && previous->sa_handler != SIG_IGN) {
+    previous->sa_handler(sig);
+  } else {
+    /* fault again with the default action */
+    signal(sig, SIG_DFL);
+  }
+}
+
+static void mininez_InstallStackGuardOnce(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = mininez_StackOverflowHandler;
+  sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, &mininez_previous_segv);
+  sigaction(SIGBUS, &sa, &mininez_previous_bus);
+}
+
+static void mininez_InstallStackGuard(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, mininez_InstallStackGuardOnce);
+}
+
+static int mininez_AllocStack(Context ctx, size_t length) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (sizeof(*ctx->stack_pointer) * length + page - 1) & ~(page - 1);
+  char *region = (char *)mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (region == MAP_FAILED) {
+    return 0;
+  }
+  if (mprotect(region + size, page, PROT_NONE) != 0) {
+    munmap(region, size + page);
+    return 0;
+  }
+  ctx->stack_pointer_base = (void *)region;
+  ctx->stack_pointer = ctx->stack_pointer_base;
+  ctx->stack_pointer32 = (uint32_t *)ctx->stack_pointer_base;
+  ctx->stack_size = size / sizeof(*ctx->stack_pointer);
+  ctx->stack_guard = region + size;
+  ctx->stack_guard_size = page;
+  return 1;
+}
+
+Context mininez_CreateContext(Grammar g) {
   Context ctx = (Context)malloc(sizeof(struct Context));
+  if (ctx == NULL) {
+    return NULL;
+  }
+  ctx->grammar = g;
+  ctx->entry = 0;
+  ctx->dispatch = MININEZ_DISPATCH_DEFAULT;
+  ctx->frames = MININEZ_FRAMES_DEFAULT;
+  ctx->inputs = NULL;
   ctx->input_size = 0;
-  ctx->inputs = loadFile(filename, &ctx->input_size);
-#if USE_STACK_ENTRY == 1
-  ctx->stack_pointer_base =
-      (StackEntry)malloc(sizeof(struct StackEntry) * CONTEXT_MAX_STACK_LENGTH);
-  ctx->stack_pointer = &ctx->stack_pointer_base[0];
-#else
-  ctx->stack_pointer_base =
-      (long* )malloc(sizeof(long) * CONTEXT_MAX_STACK_LENGTH);
-  ctx->stack_pointer = &ctx->stack_pointer_base[0];
-#endif
-  ctx->stack_size = CONTEXT_MAX_STACK_LENGTH;
+  ctx->input_mapped = 0;
+  ctx->buffer = NULL;
+  ctx->buffer_capacity = 0;
+  ctx->pos = 0;
+  ctx->stream_window = 0;
+  ctx->stream_mark = NULL;
+  ctx->stack_guard_enabled = 0;
+  if (!mininez_AllocStack(ctx, CONTEXT_MAX_STACK_LENGTH)) {
+    free(ctx);
+    return NULL;
+  }
+  ctx->memo = NULL;
+  ctx->reparse = NULL;
+  ctx->ast = NULL;
+  ctx->profile = NULL;
+  ctx->trace = 0;
+  ctx->count_dispatch = 0;
+  ctx->dispatch_count = 0;
   return ctx;
 }
 
-#if STACK_USAGE == 1
-int max_stack_size = 0;
-#endif
+void mininez_DisposeContext(Context ctx) {
+  mininez_UnloadInput(ctx);
+  munmap((void *)ctx->stack_pointer_base,
+      (size_t)(ctx->stack_guard - (char *)ctx->stack_pointer_base) + ctx->stack_guard_size);
+  if (ctx->memo) {
+    memo_dispose(ctx->memo);
+  }
+  if (ctx->reparse) {
+    reparse_dispose(ctx->reparse);
+  }
+  if (ctx->ast) {
+    ast_dispose(ctx->ast);
+  }
+  if (ctx->profile) {
+    profile_dispose(ctx->profile);
+  }
+  free(ctx->buffer);
+  free(ctx);
+}
+
+/* a Context parses one input at a time and is reused for the next one */
+int mininez_LoadInput(Context ctx, const char *filename) {
+  struct stat st;
+  mininez_UnloadInput(ctx);
+  ctx->inputs = loadFile(filename, &ctx->input_size);
+  if (ctx->inputs == NULL) {
+    return 0;
+  }
+  ctx->input_mapped = stat(filename, &st) == 0 && S_ISREG(st.st_mode);
+  ctx->pos = 0;
+  if (ctx->reparse && !reparse_reset(ctx->reparse, ctx->input_size)) {
+    return 0;
+  }
+  return 1;
+}
+
+void mininez_UnloadInput(Context ctx) {
+  if (ctx->inputs != NULL && ctx->inputs != ctx->buffer) {
+    unloadFile(ctx->inputs, ctx->input_size);
+  }
+  ctx->inputs = NULL;
+  ctx->input_size = 0;
+  ctx->input_mapped = 0;
+}
+
+/* forget the last input and the statistics; the buffer is kept */
+void mininez_ResetContext(Context ctx) {
+  mininez_UnloadInput(ctx);
+  ctx->pos = 0;
+  ctx->stack_pointer = ctx->stack_pointer_base;
+  ctx->dispatch_count = 0;
+  if (ctx->memo) {
+    memo_reset(ctx->memo);
+  }
+  if (ctx->reparse) {
+    reparse_reset(ctx->reparse, 0);
+  }
+  if (ctx->ast) {
+    ast_reset(ctx->ast);
+  }
+  if (ctx->profile) {
+    profile_reset(ctx->profile);
+  }
+}
+
+/* report an overflow of the backtrack stack instead of faulting */
+void mininez_EnableStackGuard(Context ctx) {
+  mininez_InstallStackGuard();
+  ctx->stack_guard_enabled = 1;
+}
+
+void mininez_InitMemo(Context ctx, size_t window) {
+  ctx->memo = memo_init(window, ctx->grammar->nterm_size);
+}
+
+/*
+** Keep the call results for mininez_Reparse. No instruction examines more
+** than the longest string of the grammar past pos, which is the lookahead
+** the parse adds to every position it leaves when tracking what a call
+** examined.
+*/
+int mininez_EnableReparse(Context ctx) {
+  Grammar g = ctx->grammar;
+  unsigned lookahead = 1;
+  unsigned i;
+  if (ctx->reparse != NULL) {
+    return 1;
+  }
+  for (i = 0; i < g->str_size; i++) {
+    if (pstring_length(g->strs[i]) > lookahead) {
+      lookahead = pstring_length(g->strs[i]);
+    }
+  }
+  ctx->reparse = reparse_init(lookahead);
+  if (ctx->reparse == NULL) {
+    return 0;
+  }
+  if (ctx->inputs != NULL && !reparse_reset(ctx->reparse, ctx->input_size)) {
+    reparse_dispose(ctx->reparse);
+    ctx->reparse = NULL;
+    return 0;
+  }
+  return 1;
+}
 
 #if USE_STACK_ENTRY == 1
-static inline StackEntry push_alt(Context ctx, long pos, MiniNezInstruction* jmp, StackEntry fp) {
+static inline StackEntry push_alt(Context ctx, long pos, void* jmp, StackEntry fp) {
   ctx->stack_pointer->pos = pos;
   ctx->stack_pointer->jmp = jmp;
   ctx->stack_pointer->failPoint = fp;
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
   return ctx->stack_pointer++;
 }
 #else
-static inline long* push_alt(Context ctx, long pos, MiniNezInstruction* jmp, long* fp) {
+static inline long* push_alt(Context ctx, long pos, void* jmp, long* fp) {
   long* ret = ctx->stack_pointer;
   ctx->stack_pointer[0] = pos;
   ctx->stack_pointer[1] = (long)jmp;
   ctx->stack_pointer[2] = (long)fp;
   ctx->stack_pointer += 3;
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
   return ret;
 }
 #endif
 
 static inline void push_pos(Context ctx, long pos) {
 #if USE_STACK_ENTRY == 1
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
   (ctx->stack_pointer++)->pos = pos;
 #else
   ctx->stack_pointer[0] = pos;
   ctx->stack_pointer++;
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
 #endif
 }
 
-static inline void push_call(Context ctx, MiniNezInstruction* jmp) {
+static inline void push_call(Context ctx, void* jmp) {
 #if USE_STACK_ENTRY == 1
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
   (ctx->stack_pointer++)->jmp = jmp;
 #else
   ctx->stack_pointer[0] = (long)jmp;
   ctx->stack_pointer++;
-#if STACK_USAGE == 1
-  int used = ctx->stack_pointer - ctx->stack_pointer_base;
-  if(used > max_stack_size) {
-    max_stack_size = used;
-  }
-#endif
 #endif
 }
 
 #if USE_STACK_ENTRY == 1
-static inline StackEntry peek(Context ctx) {
-  return ctx->stack_pointer;
-}
-
-static inline MiniNezInstruction* pop_jmp(Context ctx) {
+static inline void* pop_jmp(Context ctx) {
   return (--ctx->stack_pointer)->jmp;
 }
 
@@ -117,13 +276,9 @@ static inline long pop_pos(Context ctx) {
   return (--ctx->stack_pointer)->pos;
 }
 #else
-static inline long* peek(Context ctx) {
-  return ctx->stack_pointer;
-}
-
-static inline MiniNezInstruction* pop_jmp(Context ctx) {
+static inline void* pop_jmp(Context ctx) {
   --ctx->stack_pointer;
-  return (MiniNezInstruction*)ctx->stack_pointer[0];
+  return (void*)ctx->stack_pointer[0];
 }
 
 static inline long pop_pos(Context ctx) {
@@ -131,221 +286,396 @@ static inline long pop_pos(Context ctx) {
 }
 #endif
 
-#define MININEZ_USE_INDIRECT_THREADING 1
+/*
+** Compact frames (MININEZ_VM_COMPACT): 32-bit input offsets and
+** instruction indices, and alt frames linked by their distance in words.
+** The entry frame links to itself, as in the wide layout.
+*/
+static inline uint32_t* push_alt32(Context ctx, long pos, uint32_t jmp, uint32_t* fp) {
+  uint32_t* ret = ctx->stack_pointer32;
+  ret[0] = (uint32_t)pos;
+  ret[1] = jmp;
+  ret[2] = (uint32_t)(ret - fp);
+  ctx->stack_pointer32 += 3;
+  return ret;
+}
 
-long mininez_vm_execute(Context ctx, MiniNezInstruction *inst) {
-  register const char *cur = ctx->inputs;
-  register MiniNezInstruction *pc;
-  register long pos = 0;
-#if USE_STACK_ENTRY == 1
-  register StackEntry failPoint = ctx->stack_pointer;
-#else
-  register long* failPoint = ctx->stack_pointer;
-#endif
+static inline void push_pos32(Context ctx, long pos) {
+  *ctx->stack_pointer32++ = (uint32_t)pos;
+}
 
-#ifdef MININEZ_USE_SWITCH_CASE_DISPATCH
-#define DISPATCH_NEXT()         goto L_vm_head
-#define DISPATCH_START(PC) L_vm_head:;switch (*PC++) {
-#define DISPATCH_END()     default: ABORT(); }
-#define LABEL(OP)          case OP
-#else
-#define LABEL(OP)          MININEZ_OP_##OP
-    static const void *__table[] = {
-#define DEFINE_TABLE(OP) &&LABEL(OP),
-        MININEZ_IR_EACH(DEFINE_TABLE)
-#undef DEFINE_TABLE
-    };
-#define DISPATCH_START(PC) DISPATCH_NEXT()
-
-#if defined(MININEZ_USE_INDIRECT_THREADING)
-#define DISPATCH_NEXT() goto *__table[(++pc)->op]
-#define fail() goto L_fail
+static inline void push_call32(Context ctx, uint32_t jmp) {
+  *ctx->stack_pointer32++ = jmp;
+}
+
+static inline uint32_t pop_index32(Context ctx) {
+  return *(--ctx->stack_pointer32);
+}
+
+static inline long pop_pos32(Context ctx) {
+  return (long)*(--ctx->stack_pointer32);
+}
+
+/*
+** Streaming mode. The parser can return to the positions saved on the
+** stack: those of the alt frames on the failPoint chain and those of
+** Ipos, which are not on it. A saved position is never below one saved
+** under it, except that Iskip moves its loop frame forward, so the
+** furthest back is the lower of the oldest frame on the chain (other than
+** the entry frame, which only leads to Iexit) and the lowest Ipos save,
+** ctx->stream_mark. Input pages before it are dropped from memory with
+** MADV_DONTNEED. The input is a private file mapping, so even a dropped
+** page would be read back from the file rather than lost.
+**
+** The check runs at Iskip and after the Irset, Iscanbyte and Iscanstr
+** runs, so the memory held follows the backtrack distance as long as the
+** input is consumed by loops; a grammar that repeats by recursion keeps
+** every call on the stack and releases little.
+*/
 #if USE_STACK_ENTRY == 1
-#define FAIL_IMPL() do {\
-  StackEntry fp = (failPoint);\
-  pos = fp->pos;\
-  pc = fp->jmp;\
-  failPoint = fp->failPoint;\
-  ctx->stack_pointer = fp;\
-  goto *__table[pc->op];\
-} while(0)
-#else
-#define FAIL_IMPL() do {\
-  long* fp = (failPoint);\
-  pos = fp[0];\
-  pc = (MiniNezInstruction *)fp[1];\
-  failPoint = (long*)fp[2];\
-  ctx->stack_pointer = fp;\
-  goto *__table[pc->op];\
-} while(0)
-#endif
-#define JUMP_ADDR(ADDR) JUMP(pc = inst + ADDR)
-#define JUMP(PC) goto *__table[(PC)->op]
-#define RET(PC) JUMP(pc = PC)
+static void mininez_StreamRelease(Context ctx, StackEntry fp, long pos) {
+  StackEntry entry = ctx->stack_pointer_base;
+  long low = pos;
+  while (fp != entry) {
+    low = fp->pos;
+    fp = fp->failPoint;
+  }
+  if (ctx->stream_mark != NULL && ((StackEntry)ctx->stream_mark)->pos < low) {
+    low = ((StackEntry)ctx->stream_mark)->pos;
+  }
 #else
-#error please specify dispatch method
-#endif
+static void mininez_StreamRelease(Context ctx, long* fp, long pos) {
+  long* entry = ctx->stack_pointer_base;
+  long low = pos;
+  while (fp != entry) {
+    low = fp[0];
+    fp = (long*)fp[2];
+  }
+  if (ctx->stream_mark != NULL && *(long*)ctx->stream_mark < low) {
+    low = *(long*)ctx->stream_mark;
+  }
 #endif
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t release = (size_t)low & ~(page - 1);
+  if (release > ctx->stream_released) {
+    madvise(ctx->inputs + ctx->stream_released,
+        release - ctx->stream_released, MADV_DONTNEED);
+    ctx->stream_released = release;
+  }
+  ctx->stream_next = pos + (long)ctx->stream_window;
+}
 
-#define OP_CASE_(OP) LABEL(OP):
+#define MININEZ_VM_EXECUTE mininez_vm_execute_fast
+#include "vm_execute.h"
 
-#if MININEZ_DEBUG == 1
-#define OP_CASE(OP) OP_CASE_(OP); fprintf(stderr, "[%ld] %s (pos:%ld)\n", pc - inst, get_opname(pc->op), pos);
-#else
-#define OP_CASE(OP) OP_CASE_(OP)
-#endif
+#define MININEZ_VM_EXECUTE mininez_vm_execute_switch
+#define MININEZ_VM_SWITCH 1
+#include "vm_execute.h"
 
-  failPoint = push_alt(ctx, pos, inst, ctx->stack_pointer);
-  push_call(ctx, inst+1);
-  pc = inst + 1;
-  DISPATCH_START(pc);
+#define MININEZ_VM_EXECUTE mininez_vm_execute_fast32
+#define MININEZ_VM_COMPACT 1
+#include "vm_execute.h"
 
-  OP_CASE(Iexit) {
-    ctx->pos = pos;
-#if MININEZ_DEBUG == 1
-    fprintf(stderr, "exit %d\n", pc->arg);
-#endif
-#if STACK_USAGE == 1
-    fprintf(stderr, "stack_usage: %lu[byte]\n", max_stack_size * sizeof(*ctx->stack_pointer));
-#endif
-    return pc->arg;
+#define MININEZ_VM_EXECUTE mininez_vm_execute_switch32
+#define MININEZ_VM_SWITCH 1
+#define MININEZ_VM_COMPACT 1
+#include "vm_execute.h"
+
+/* the direct-threaded code holds the handlers of this loop only */
+#define MININEZ_VM_EXECUTE mininez_vm_execute_direct
+#define MININEZ_VM_DIRECT 1
+#define MININEZ_VM_COMPACT 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_reparse
+#define MININEZ_VM_REPARSE 1
+#define MININEZ_VM_COMPACT 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_stream
+#define MININEZ_VM_STREAM 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_ast
+#define MININEZ_VM_AST 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_trace
+#define MININEZ_VM_TRACE 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_count
+#define MININEZ_VM_COUNT 1
+#include "vm_execute.h"
+
+#define MININEZ_VM_EXECUTE mininez_vm_execute_profile
+#define MININEZ_VM_PROFILE 1
+#include "vm_execute.h"
+
+/*
+** Release the input prefix every window bytes. Only file mappings can be
+** streamed: a pipe has been read into anonymous memory, where a dropped
+** page cannot be recovered. Such inputs are parsed whole, and 0 is
+** returned when the current input is one of them.
+*/
+int mininez_EnableStream(Context ctx, size_t window) {
+  ctx->stream_window = window;
+  return ctx->input_mapped;
+}
+
+void mininez_EnableAst(Context ctx) {
+  ctx->ast = ast_init();
+}
+
+/* profile the nonterminals; the results add up over the parses */
+void mininez_EnableProfile(Context ctx) {
+  ctx->profile = profile_init(ctx->grammar->nterm_size);
+}
+
+/*
+** Translate the instructions to direct-threaded code. Like the native
+** code, it is built once per grammar and read by every context.
+*/
+int mininez_ThreadGrammar(Grammar g) {
+  const void **handlers = (const void **)(uintptr_t)mininez_vm_execute_direct(NULL, NULL);
+  MiniNezThreaded *code;
+  unsigned i, c;
+  if (g->threaded != NULL) {
+    return 1;
   }
-  OP_CASE(Inop) {
-    DISPATCH_NEXT();
+  code = (MiniNezThreaded *)malloc(sizeof(MiniNezThreaded) * g->inst_size);
+  if (code == NULL) {
+    return 0;
   }
-  OP_CASE(Ifail) {
-  L_fail:
-    FAIL_IMPL();
+  if (g->jump_table_size > 0) {
+    g->threaded_tables = (MiniNezThreaded **)malloc(
+        sizeof(MiniNezThreaded *) * 256 * g->jump_table_size);
+    if (g->threaded_tables == NULL) {
+      free(code);
+      return 0;
+    }
+    for (i = 0; i < g->jump_table_size; i++) {
+      for (c = 0; c < 256; c++) {
+        g->threaded_tables[i * 256 + c] = code + g->jump_tables[i].target[c];
+      }
+    }
   }
-  OP_CASE(Ialt) {
-    failPoint = push_alt(ctx, pos, inst+pc->arg, failPoint);
-    DISPATCH_NEXT();
+  for (i = 0; i < g->inst_size; i++) {
+    MiniNezInstruction *inst = &g->inst[i];
+    code[i].handler = handlers[inst->op];
+    switch (inst->op) {
+      case MININEZ_OP_Ialt:
+      case MININEZ_OP_Ijump:
+      case MININEZ_OP_Icall:
+      case MININEZ_OP_Iskip:
+      case MININEZ_OP_Ianyskip:
+        code[i].u.target = code + inst->arg;
+        break;
+      case MININEZ_OP_Ifirst:
+        code[i].u.table = g->threaded_tables + 256 * inst->arg;
+        break;
+      case MININEZ_OP_Istr:
+      case MININEZ_OP_Instr:
+      case MININEZ_OP_Iostr:
+      case MININEZ_OP_Instrany:
+      case MININEZ_OP_Iscanstr:
+        code[i].u.str = g->strs[inst->arg];
+        break;
+      case MININEZ_OP_Iset:
+      case MININEZ_OP_Ioset:
+      case MININEZ_OP_Irset:
+        code[i].u.row = g->class_sets + ((size_t)inst->arg << g->class_shift);
+        break;
+      default:
+        code[i].u.arg = inst->arg;
+        break;
+    }
   }
-  OP_CASE(Isucc) {
-    ctx->stack_pointer = failPoint;
-#if USE_STACK_ENTRY == 1
-    failPoint = failPoint->failPoint;
-#else
-    failPoint = (long*)failPoint[2];
-#endif
-    DISPATCH_NEXT();
+  g->threaded = code;
+  g->memory_size += sizeof(MiniNezThreaded) * g->inst_size
+      + sizeof(MiniNezThreaded *) * 256 * g->jump_table_size;
+  if (g->verbose) {
+    fprintf(stderr, "threaded: %zu [byte] direct-threaded code\n",
+        sizeof(MiniNezThreaded) * g->inst_size
+        + sizeof(MiniNezThreaded *) * 256 * g->jump_table_size);
   }
-  OP_CASE(Ijump) {
-    JUMP_ADDR(pc->arg);
+  return 1;
+}
+
+long mininez_vm_execute(Context ctx, MiniNezInstruction *inst) {
+  long ret;
+  int dispatch = ctx->dispatch;
+  int compact = ctx->frames == MININEZ_FRAMES_DEFAULT
+      && ctx->input_size <= MININEZ_COMPACT_INPUT_LIMIT;
+  ctx->stack_pointer = ctx->stack_pointer_base;
+  ctx->stack_pointer32 = (uint32_t *)ctx->stack_pointer_base;
+  if (ctx->stack_guard_enabled) {
+    mininez_running_ctx = ctx;
+    if (sigsetjmp(ctx->stack_overflow, 0) != 0) {
+      ctx->stack_pointer = ctx->stack_pointer_base;
+      mininez_running_ctx = NULL;
+      return MININEZ_STACK_OVERFLOW;
+    }
   }
-  OP_CASE(Icall) {
-    push_call(ctx, pc+1);
-    JUMP_ADDR(pc->arg);
+  if (ctx->trace) {
+    ret = mininez_vm_execute_trace(ctx, inst);
   }
-  OP_CASE(Iret) {
-    MiniNezInstruction* tmp = pop_jmp(ctx);
-    RET(tmp);
+  else if (ctx->count_dispatch) {
+    ret = mininez_vm_execute_count(ctx, inst);
   }
-  OP_CASE(Ipos) {
-    push_pos(ctx, pos);
-    DISPATCH_NEXT();
+  else if (ctx->profile) {
+    uint64_t start = profile_clock();
+    ctx->profile->frame_size = 0;
+    ret = mininez_vm_execute_profile(ctx, inst);
+    profile_finish(ctx->profile, ctx->dispatch_count, profile_clock() - start);
   }
-  OP_CASE(Iback) {
-    pos = pop_pos(ctx);
-    DISPATCH_NEXT();
+  else if (ctx->ast) {
+    ast_reset(ctx->ast);
+    ret = mininez_vm_execute_ast(ctx, inst);
+    if (ret == 1) {
+      ast_build(ctx->ast);
+    }
   }
-  OP_CASE(Iskip) {
-#if USE_STACK_ENTRY == 1
-    StackEntry top = peek(ctx);
-    if(pos == top->pos) {
-      fail();
+  else if (ctx->reparse && compact) {
+    ret = mininez_vm_execute_reparse(ctx, inst);
+  }
+  else if (ctx->stream_window > 0 && ctx->input_mapped) {
+    ctx->stream_next = (long)ctx->stream_window;
+    ctx->stream_released = 0;
+    ctx->stream_mark = NULL;
+    ret = mininez_vm_execute_stream(ctx, inst);
+  }
+  else if (ctx->grammar->jit_code != NULL && ctx->memo == NULL
+      && dispatch == MININEZ_DISPATCH_DEFAULT) {
+    ret = mininez_vm_execute_jit(ctx);
+  }
+  else {
+    if (dispatch == MININEZ_DISPATCH_DEFAULT) {
+      dispatch = MININEZ_DISPATCH_DIRECT;
     }
-    failPoint->pos = pos;
-#else
-    long* top = peek(ctx);
-    if(pos == *top) {
-      fail();
+    if (dispatch == MININEZ_DISPATCH_SWITCH) {
+      ret = compact ? mininez_vm_execute_switch32(ctx, inst)
+          : mininez_vm_execute_switch(ctx, inst);
     }
-    failPoint[0] = pos;
-#endif
-    JUMP_ADDR(pc->arg);
-  }
-  OP_CASE(Ibyte) {
-    if(cur[pos] != pc->arg) {
-      fail();
+    else if (dispatch == MININEZ_DISPATCH_DIRECT && compact
+        && ctx->grammar->threaded != NULL) {
+      ret = mininez_vm_execute_direct(ctx, inst);
     }
-    ++pos;
-    DISPATCH_NEXT();
+    else {
+      ret = compact ? mininez_vm_execute_fast32(ctx, inst)
+          : mininez_vm_execute_fast(ctx, inst);
+    }
+  }
+  if (ctx->stack_guard_enabled) {
+    mininez_running_ctx = NULL;
   }
-  OP_CASE(Iany) {
-    if(cur[pos] == 0) {
-      fail();
+  return ret;
+}
+
+static int mininez_ReserveBuffer(Context ctx, size_t length) {
+  if (length + MININEZ_INPUT_PADDING > ctx->buffer_capacity) {
+    size_t capacity = ctx->buffer_capacity ? ctx->buffer_capacity : 256;
+    char *buffer;
+    while (capacity < length + MININEZ_INPUT_PADDING) {
+      capacity *= 2;
     }
-    ++pos;
-    DISPATCH_NEXT();
-  }
-  OP_CASE(Istr) {
-    const char* str = ctx->strs[pc->arg];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(cur+pos, str, len) == 0) {
-      fail();
+    buffer = (char *)realloc(ctx->buffer, capacity);
+    if (buffer == NULL) {
+      return 0;
     }
-    pos += len;
-    DISPATCH_NEXT();
+    ctx->buffer = buffer;
+    ctx->buffer_capacity = capacity;
   }
-  OP_CASE(Iset) {
-    bitset_t set = ctx->sets[pc->arg];
-    if (!bitset_get(&set, cur[pos])) {
-      fail();
-    }
-    ++pos;
-    DISPATCH_NEXT();
+  return 1;
+}
+
+static int mininez_ParseStatus(Context ctx) {
+  long ret = mininez_vm_execute(ctx, ctx->grammar->inst);
+  if (ret == MININEZ_STACK_OVERFLOW) {
+    return MININEZ_OVERFLOW;
   }
-  OP_CASE(Inbyte) {
-    if(cur[pos] != pc->arg) {
-      DISPATCH_NEXT();
-    }
-    fail();
+  if (!ret) {
+    return MININEZ_NOMATCH;
   }
-	OP_CASE(Instr) {
-    const char* str = ctx->strs[pc->arg];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(cur+pos, str, len) == 0) {
-      DISPATCH_NEXT();
-    }
-    fail();
+  return ctx->pos == (long)ctx->input_size ? MININEZ_MATCH : MININEZ_PARTIAL;
+}
+
+int mininez_Parse(Context ctx, const char *input, size_t length) {
+  mininez_UnloadInput(ctx);
+  if (!mininez_ReserveBuffer(ctx, length)) {
+    return MININEZ_ERROR;
   }
-  OP_CASE(Iostr) {
-    const char* str = ctx->strs[pc->arg];
-    unsigned len = pstring_length(str);
-    if (pstring_starts_with(cur+pos, str, len) == 0) {
-      DISPATCH_NEXT();
-    }
-    pos += len;
-    DISPATCH_NEXT();
+  memcpy(ctx->buffer, input, length);
+  memset(ctx->buffer + length, 0, MININEZ_INPUT_PADDING);
+  ctx->inputs = ctx->buffer;
+  ctx->input_size = length;
+  if (ctx->reparse && !reparse_reset(ctx->reparse, length)) {
+    return MININEZ_ERROR;
   }
-  OP_CASE(Ioset) {
-    bitset_t set = ctx->sets[pc->arg];
-    if (!bitset_get(&set, cur[pos])) {
-      DISPATCH_NEXT();
-    }
-    ++pos;
-    DISPATCH_NEXT();
+  return mininez_ParseStatus(ctx);
+}
+
+/*
+** Edit the input of the last parse in place (a mapped file is copied into
+** the buffer first) and drop the call results the edit may change.
+*/
+int mininez_Edit(Context ctx, size_t start, size_t removed, const char *text, size_t inserted) {
+  size_t length = ctx->input_size;
+  if (ctx->inputs == NULL || start > length || removed > length - start) {
+    return 0;
   }
-  OP_CASE(Irset) {
-    while(1) {
-      bitset_t set = ctx->sets[pc->arg];
-      if (!bitset_get(&set, cur[pos])) {
-        break;
-      }
-      ++pos;
+  if (ctx->inputs != ctx->buffer) {
+    if (!mininez_ReserveBuffer(ctx, length)) {
+      return 0;
     }
-    DISPATCH_NEXT();
+    memcpy(ctx->buffer, ctx->inputs, length);
+    mininez_UnloadInput(ctx);
+    ctx->inputs = ctx->buffer;
+    ctx->input_size = length;
   }
-  OP_CASE(Ilabel) {
-#if MININEZ_DEBUG == 1
-    fprintf(stderr, "%s\n", ctx->nterms[pc->arg]);
-#endif
-    DISPATCH_NEXT();
+  if (!mininez_ReserveBuffer(ctx, length - removed + inserted)) {
+    return 0;
+  }
+  memmove(ctx->buffer + start + inserted, ctx->buffer + start + removed,
+      length - start - removed);
+  memcpy(ctx->buffer + start, text, inserted);
+  ctx->input_size = length - removed + inserted;
+  memset(ctx->buffer + ctx->input_size, 0, MININEZ_INPUT_PADDING);
+  ctx->inputs = ctx->buffer;
+  if (ctx->reparse && !reparse_edit(ctx->reparse, start, removed, inserted)) {
+    return reparse_reset(ctx->reparse, ctx->input_size);
+  }
+  return 1;
+}
+
+int mininez_Reparse(Context ctx) {
+  if (ctx->inputs == NULL) {
+    return MININEZ_ERROR;
+  }
+  return mininez_ParseStatus(ctx);
+}
+
+size_t mininez_MatchLength(Context ctx) {
+  return ctx->pos > 0 ? (size_t)ctx->pos : 0;
+}
+
+int mininez_SetEntryPoint(Context ctx, const char *nterm) {
+  Grammar g = ctx->grammar;
+  size_t len = strlen(nterm);
+  unsigned i;
+  for (i = 0; i < g->entry_size; i++) {
+    unsigned id = g->entries[i].nterm;
+    if (id < g->nterm_size && pstring_length(g->nterms[id]) == len
+        && memcmp(g->nterms[id], nterm, len) == 0) {
+      ctx->entry = i;
+      return 1;
+    }
   }
   return 0;
 }
 
+#ifndef MININEZ_NO_MAIN
+/* a single timed parse; see bench/mininez_bench.c for measurements */
 static uint64_t timer() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -355,23 +685,50 @@ static uint64_t timer() {
 static void nez_ShowUsage(const char *file) {
   // fprintf(stderr, "Usage: %s -f nez_bytecode target_file\n", file);
   fprintf(stderr, "\nnezvm <command> optional files\n");
-  fprintf(stderr, "  -p <filename> Specify an PEGs grammar bytecode file\n");
+  fprintf(stderr, "  -p <filename> Specify an PEGs grammar bytecode file (or an image from -S)\n");
   fprintf(stderr, "  -i <filename> Specify an input file\n");
+  fprintf(stderr, "  -b <filename> Parse every file listed (one path per line) in the file\n");
+  fprintf(stderr, "  -j <threads>  Number of parser threads for -b (default: online cores)\n");
   fprintf(stderr, "  -o <filename> Specify an output file\n");
-  fprintf(stderr, "  -t <type>     Specify an output type\n");
+  fprintf(stderr, "  -t <type>     Specify an output type (ast: print the parse tree)\n");
+  fprintf(stderr, "  -m <window>   Memoize nonterminal calls over the last <window> positions\n");
+  fprintf(stderr, "  -s <bytes>    Stream the input, releasing the parsed prefix every <bytes>\n");
+  fprintf(stderr, "  -O <level>    Optimize the loaded bytecode (0: load it as is, default: 1)\n");
+  fprintf(stderr, "  -I <size>     Inline nonterminals of up to <size> instructions (0: none, default: 8)\n");
+  fprintf(stderr, "  -J            Compile the grammar to native code (x86-64)\n");
+  fprintf(stderr, "  -D            Interpret direct-threaded code instead of the bytecode\n");
+  fprintf(stderr, "  -d            Trace the loaded bytecode and every dispatched instruction\n");
+  fprintf(stderr, "  -e <names>    Entry points: the nonterminals to keep and parse from (default: the first)\n");
+  fprintf(stderr, "  -S <filename> Save the loaded grammar as an image for -p and exit\n");
+  fprintf(stderr, "  -P <filename> Profile the nonterminals: report to stderr, folded stacks to the file\n");
   fprintf(stderr, "  -h            Display this help and exit\n\n");
   exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *const argv[]) {
   Context ctx = NULL;
-  MiniNezInstruction *inst = NULL;
+  Grammar g = NULL;
   const char *syntax_file = NULL;
   const char *input_file = NULL;
+  const char *batch_file = NULL;
   const char *output_type = NULL;
+  const char *output_file = NULL;
+  const char *profile_file = NULL;
+  const char *image_file = NULL;
+  const char *entry_points = NULL;
   const char *orig_argv0 = argv[0];
+  size_t memo_window = 0;
+  size_t stream_window = 0;
+  int threads = 0;
+  int optimize = 1;
+  int inline_size = -1;
+  int jit = 0;
+  int direct = 0;
+  int trace = 0;
   int opt;
-  while ((opt = getopt(argc, argv, "p:i:t:o:c:h:")) != -1) {
+  uint64_t start, end;
+  long result;
+  while ((opt = getopt(argc, argv, "p:i:b:j:t:o:c:m:s:O:I:JDdP:S:e:h:")) != -1) {
     switch (opt) {
     case 'p':
       syntax_file = optarg;
@@ -379,9 +736,48 @@ int main(int argc, char *const argv[]) {
     case 'i':
       input_file = optarg;
       break;
+    case 'b':
+      batch_file = optarg;
+      break;
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'o':
+      output_file = optarg;
+      break;
     case 't':
       output_type = optarg;
       break;
+    case 'm':
+      memo_window = (size_t)atol(optarg);
+      break;
+    case 's':
+      stream_window = (size_t)atol(optarg);
+      break;
+    case 'O':
+      optimize = atoi(optarg);
+      break;
+    case 'I':
+      inline_size = atoi(optarg);
+      break;
+    case 'J':
+      jit = 1;
+      break;
+    case 'D':
+      direct = 1;
+      break;
+    case 'd':
+      trace = 1;
+      break;
+    case 'P':
+      profile_file = optarg;
+      break;
+    case 'S':
+      image_file = optarg;
+      break;
+    case 'e':
+      entry_points = optarg;
+      break;
     case 'h':
       nez_ShowUsage(orig_argv0);
     default: /* '?' */
@@ -391,23 +787,89 @@ int main(int argc, char *const argv[]) {
   if (syntax_file == NULL) {
     nez_PrintErrorInfo("not input syntaxfile");
   }
-  ctx = mininez_CreateContext(input_file);
-  inst = loadMachineCode(ctx, syntax_file, "File");
-#if MININEZ_LOAD_DEBUG == 0
-  for(int i = 0; i < 5; i++) {
-    uint64_t start, end;
-    start = timer();
-    if(!mininez_vm_execute(ctx, inst)) {
-      nez_PrintErrorInfo("parse error!!");
-    } else if(ctx->pos != (long)ctx->input_size) {
-      fprintf(stderr, "unconsumed!! pos=%ld size=%zu", ctx->pos, ctx->input_size);
-    } else {
-      fprintf(stderr, "match!!\n");
+  g = loadMachineCode(syntax_file, entry_points, trace, optimize, inline_size);
+  if (image_file != NULL) {
+    const char *error = NULL;
+    if (!mininez_SaveGrammarImage(g, image_file, &error)) {
+      nez_PrintErrorInfo(error);
     }
-    end = timer();
-    fprintf(stderr, "ErapsedTime: %llu msec\n", (unsigned long long)end - start);
-    ctx->pos = 0;
+    mininez_DisposeGrammar(g);
+    return 0;
   }
-#endif
+  if (direct && !mininez_ThreadGrammar(g)) {
+    nez_PrintErrorInfo("malloc error: cannot translate to direct-threaded code");
+  }
+  if (jit && !mininez_CompileGrammar(g)) {
+    fprintf(stderr, "jit is not available; interpreting\n");
+  }
+  if (batch_file != NULL) {
+    return mininez_ParseBatch(g, batch_file, threads, memo_window, stream_window);
+  }
+  ctx = mininez_CreateContext(g);
+  if (ctx == NULL) {
+    nez_PrintErrorInfo("mmap error: cannot reserve the backtrack stack");
+  }
+  mininez_EnableStackGuard(ctx);
+  ctx->trace = trace;
+  if (!mininez_LoadInput(ctx, input_file)) {
+    nez_PrintErrorInfo("open error: cannot open file");
+  }
+  if (memo_window > 0) {
+    mininez_InitMemo(ctx, memo_window);
+  }
+  if (stream_window > 0 && !mininez_EnableStream(ctx, stream_window)) {
+    fprintf(stderr, "streaming needs a regular input file; reading it whole\n");
+  }
+  if (output_type != NULL && strcmp(output_type, "ast") == 0) {
+    mininez_EnableAst(ctx);
+  }
+  if (profile_file != NULL) {
+    if (ctx->ast) {
+      fprintf(stderr, "the profiler does not build the tree; ignoring -t ast\n");
+      ast_dispose(ctx->ast);
+      ctx->ast = NULL;
+    }
+    mininez_EnableProfile(ctx);
+  }
+  start = timer();
+  result = mininez_vm_execute(ctx, g->inst);
+  if(result == MININEZ_STACK_OVERFLOW) {
+    nez_PrintErrorInfo("stack overflow!!");
+  } else if(!result) {
+    nez_PrintErrorInfo("parse error!!");
+  } else if(ctx->pos != (long)ctx->input_size) {
+    fprintf(stderr, "unconsumed!! pos=%ld size=%zu", ctx->pos, ctx->input_size);
+  } else {
+    fprintf(stderr, "match!!\n");
+  }
+  end = timer();
+  fprintf(stderr, "ErapsedTime: %llu msec\n", (unsigned long long)end - start);
+  if (ctx->memo) {
+    memo_report(ctx->memo, stderr);
+  }
+  if (ctx->profile) {
+    FILE *fp = fopen(profile_file, "w");
+    if (fp == NULL) {
+      nez_PrintErrorInfo("fopen error: cannot open profile file");
+    }
+    profile_report(ctx->profile, g->nterms, stderr);
+    fprintf(stderr, "note: the optimizer inlines small nonterminals and turns tail calls into jumps;"
+        " their cost is charged to the caller (use -O0 to profile every call)\n");
+    profile_dump_folded(ctx->profile, g->nterms, fp);
+    fclose(fp);
+  }
+  if (ctx->ast) {
+    FILE *fp = output_file ? fopen(output_file, "w") : stdout;
+    if (fp == NULL) {
+      nez_PrintErrorInfo("fopen error: cannot open output file");
+    }
+    ast_dump(ctx->ast, ctx->inputs, g->tags, g->tag_size, fp);
+    if (fp != stdout) {
+      fclose(fp);
+    }
+  }
+  mininez_DisposeContext(ctx);
+  mininez_DisposeGrammar(g);
   return 0;
 }
+#endif /* MININEZ_NO_MAIN */
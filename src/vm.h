@@ -1,16 +1,22 @@
 #include <stdio.h>
 #include <stdint.h>
+#include <setjmp.h>
 #include <assert.h>
 #include "bitset.h"
+#include "charclass.h"
 #include "pstring.h"
+#include "memo.h"
+#include "reparse.h"
+#include "profile.h"
+#include "ast.h"
+#include "mininez.h"
 
 #ifndef VM_H
 #define VM_H
 
-#define MININEZ_DEBUG 1
+#ifndef USE_STACK_ENTRY
 #define USE_STACK_ENTRY 0
-#define MININEZ_LOAD_DEBUG 1
-#define STACK_USAGE 1
+#endif
 
 #define MININEZ_IR_EACH(OP)\
 	OP(Inop)\
@@ -33,7 +39,19 @@
 	OP(Ioset)\
 	OP(Irset)\
 	OP(Iexit)\
-	OP(Ilabel)
+	OP(Ilabel)\
+	OP(Imemofail)\
+	OP(Imemosucc)\
+	OP(Inew)\
+	OP(Itag)\
+	OP(Ilink)\
+	OP(Icapture)\
+	OP(Inbyteany)\
+	OP(Instrany)\
+	OP(Ianyskip)\
+	OP(Ifirst)\
+	OP(Iscanbyte)\
+	OP(Iscanstr)
 
 enum nezvm_opcode {
 #define DEFINE_ENUM(NAME) MININEZ_OP_##NAME,
@@ -42,25 +60,139 @@ enum nezvm_opcode {
   MININEZ_OP_ERROR = -1
 };
 
+/* instructions reserved in front of the loaded bytecode */
+#define MININEZ_INST_EXIT_FAIL 0
+#define MININEZ_INST_EXIT_SUCC 1
+#define MININEZ_INST_MEMO_FAIL 2
+#define MININEZ_INST_MEMO_SUCC 3
+#define MININEZ_INST_OFFSET    4
+
+/*
+** One 32-bit word per instruction: jump targets (instruction addresses)
+** and pool indices are stored in arg. Icall is followed by an extension
+** word whose arg holds the nonterminal id.
+*/
 typedef struct MiniNezInstruction {
-	unsigned short op : 5;
-	short arg : 11;
+	unsigned op : 8;
+	unsigned arg : 24;
 } MiniNezInstruction;
+#define MININEZ_INST_ARG_MAX ((1U << 24) - 1)
+
+/* an entry point: the code of nonterminal nterm starts at inst[addr] */
+typedef struct MiniNezEntry {
+	unsigned nterm;
+	unsigned addr;
+} MiniNezEntry;
+
+/* Ifirst targets, indexed by the next input byte */
+typedef struct MiniNezJumpTable {
+	unsigned target[256];
+} MiniNezJumpTable;
+
+/*
+** Direct-threaded code (mininez_ThreadGrammar): one slot per instruction,
+** at the same index, holding the address of the handler in
+** mininez_vm_execute_direct and the operand in the form the handler
+** uses it. Jumps hold the target slot, Ifirst its table of target slots,
+** string operands the pstring and set operands the row in class_sets.
+*/
+typedef struct MiniNezThreaded {
+	const void* handler;
+	union {
+		unsigned long arg;
+		struct MiniNezThreaded* target;
+		struct MiniNezThreaded** table;
+		const char* str;
+		const uint8_t* row;
+	} u;
+} MiniNezThreaded;
+
+/*
+** A loaded grammar. It is never written after loadMachineCode returns,
+** so one Grammar is shared by every Context parsing with it, on any
+** number of threads.
+*/
+struct Grammar {
+	MiniNezInstruction* inst;
+	unsigned inst_size;
+	const char** nterms;
+	unsigned nterm_size;
+	bitset_t* sets;
+	unsigned set_size;
+	/*
+	** The set pool by byte equivalence classes: bytes that no set tells
+	** apart share a class, and row s of class_sets (1 << class_shift
+	** bytes) is the bitmap of the classes in set s.
+	*/
+	uint8_t* byte_class;
+	uint8_t* class_sets;
+	unsigned class_shift;
+	unsigned class_size;
+	/* sets precompiled for the Irset scan, same index as sets */
+	charclass_t* classes;
+	int charclass_kernel;
+	const char** strs;
+	unsigned str_size;
+	const char** tags;
+	unsigned tag_size;
+	MiniNezJumpTable* jump_tables;
+	unsigned jump_table_size;
+	/* in start_point order; entries[0] is where a context starts by default */
+	MiniNezEntry* entries;
+	unsigned entry_size;
+	size_t memory_size;
+	/* native code from mininez_CompileGrammar, or NULL */
+	void* jit_code;
+	size_t jit_size;
+	/* the offset in jit_code of each entry point */
+	size_t* jit_entries;
+	/* direct-threaded code from mininez_ThreadGrammar, or NULL */
+	MiniNezThreaded* threaded;
+	MiniNezThreaded** threaded_tables;
+	/* MININEZ_LOAD_VERBOSE: print load and compile statistics */
+	int verbose;
+	/* the mapped image the pools point into (image.c), or NULL */
+	char* image;
+	size_t image_size;
+};
 
 #if USE_STACK_ENTRY == 1
 struct StackEntry {
   long pos;
-  MiniNezInstruction* jmp;
+  void* jmp;
 	struct StackEntry* failPoint;
 };
 #endif
 
+/* the state of one parser; a thread parses with its own Context */
 struct Context {
+  struct Grammar* grammar;
+  /* the index in grammar->entries to parse from */
+  unsigned entry;
+  /* the loop of the plain parses (enum MiniNezDispatch) */
+  int dispatch;
+  /* the backtrack frames of the plain parses (enum MiniNezFrames) */
+  int frames;
   char *inputs;
   size_t input_size;
 	long pos;
+  int input_mapped;
+  /* mininez_Parse copies its input here, followed by the zero padding */
+  char *buffer;
+  size_t buffer_capacity;
+
+  /* streaming mode: release the input before stream_released */
+  size_t stream_window;
+  size_t stream_released;
+  long stream_next;
+  /* the lowest Ipos save on the stack, or NULL */
+  void* stream_mark;
 
   size_t stack_size;
+  char* stack_guard;
+  size_t stack_guard_size;
+  int stack_guard_enabled;
+  sigjmp_buf stack_overflow;
 
 #if USE_STACK_ENTRY == 1
   struct StackEntry* stack_pointer;
@@ -69,17 +201,64 @@ struct Context {
 	long* stack_pointer;
 	long* stack_pointer_base;
 #endif
+  /* the top of the same stack in the loops with compact frames */
+  uint32_t* stack_pointer32;
 
-	const char** nterms;
-	bitset_t* sets;
-	const char** strs;
+	MemoTable* memo;
+	/* the call results kept for mininez_Reparse, or NULL */
+	ReparseTable* reparse;
+	AstTree* ast;
+	Profile* profile;
+	int trace;
+	/* count the dispatched instructions of the next parse (benchmarks) */
+	int count_dispatch;
+	size_t dispatch_count;
+};
+/*
+** Context.dispatch. By default a parse that needs no trace, tree, stream
+** or profile runs the native code if the grammar is compiled, else the
+** direct-threaded code if it is translated, else the indirect-threaded
+** loop; the others force a loop (for benchmarks). The direct-threaded loop
+** only has compact frames, so with wide ones it falls back to indirect.
+*/
+enum MiniNezDispatch {
+  MININEZ_DISPATCH_DEFAULT,
+  MININEZ_DISPATCH_INDIRECT,
+  MININEZ_DISPATCH_SWITCH,
+  MININEZ_DISPATCH_DIRECT
+};
+
+/*
+** Context.frames. By default the interpreter keeps 32-bit frames when the
+** input offsets fit (MININEZ_COMPACT_INPUT_LIMIT), which halves the stack
+** traffic of backtracking; MININEZ_FRAMES_WIDE forces the 64-bit frames
+** (for benchmarks). The native code always uses the 64-bit frames.
+*/
+enum MiniNezFrames {
+  MININEZ_FRAMES_DEFAULT,
+  MININEZ_FRAMES_WIDE
 };
-#define CONTEXT_MAX_STACK_LENGTH 1024
+
+/* reserved stack entries; pages are committed as the stack grows */
+#define CONTEXT_MAX_STACK_LENGTH (1UL << 24)
+
+/* loaded inputs are followed by at least this many zero bytes */
+#define MININEZ_INPUT_PADDING 64
+#if MININEZ_INPUT_PADDING < PSTRING_PADDING
+#error the input padding must cover the wide loads of pstring.h
+#endif
+
+/* the largest input parsed with compact frames; pos may run into the padding */
+#define MININEZ_COMPACT_INPUT_LIMIT ((size_t)UINT32_MAX - MININEZ_INPUT_PADDING)
+
+/* mininez_vm_execute result when the backtrack stack overflows */
+#define MININEZ_STACK_OVERFLOW (-1)
 
 typedef struct StackEntry* StackEntry;
 typedef struct Context* Context;
+typedef struct Grammar* Grammar;
 
-static const char *get_opname(uint8_t opcode) {
+static inline const char *get_opname(uint8_t opcode) {
   switch (opcode) {
 #define OP_DUMPCASE(OP) \
   case MININEZ_OP_##OP:   \
@@ -95,6 +274,21 @@ static const char *get_opname(uint8_t opcode) {
 }
 
 void nez_PrintErrorInfo(const char *errmsg);
-MiniNezInstruction* loadMachineCode(Context ctx, const char* code_file, const char* start_point);
+Grammar loadMachineCode(const char* code_file, const char* start_point, int trace, int optimize,
+    int inline_size);
+int mininez_CompileGrammar(Grammar g);
+int mininez_ThreadGrammar(Grammar g);
+int mininez_IsGrammarImage(const void *code, size_t length);
+Grammar mininez_LoadGrammarImage(char *image, size_t image_size, int flags, const char **error);
+long mininez_vm_execute_jit(Context ctx);
+int mininez_LoadInput(Context ctx, const char *filename);
+void mininez_UnloadInput(Context ctx);
+long mininez_vm_execute(Context ctx, MiniNezInstruction *inst);
+void mininez_InitMemo(Context ctx, size_t window);
+int mininez_EnableStream(Context ctx, size_t window);
+void mininez_EnableAst(Context ctx);
+void mininez_EnableProfile(Context ctx);
+int mininez_ParseBatch(Grammar g, const char *list_file, int threads,
+    size_t memo_window, size_t stream_window);
 
 #endif
@@ -0,0 +1,644 @@
+/*
+** The body of the VM dispatch loop. This file has no include guard: vm.c
+** includes it once per variant with the following parameters, which
+** default to 0 and are undefined again at the end of this file.
+**   MININEZ_VM_EXECUTE  the name of the generated function
+**   MININEZ_VM_TRACE    1 to print every dispatched instruction and
+**                       track the stack usage, 0 for the stripped loop
+**   MININEZ_VM_STREAM   1 to release the parsed prefix of the input
+**                       in loops and scans (see mininez_StreamRelease)
+**   MININEZ_VM_AST      1 to log tree operations; every alt frame then
+**                       sits on top of the log size to roll back to
+**   MININEZ_VM_COUNT    1 to count the dispatched instructions into
+**                       ctx->dispatch_count (the trace loop counts too)
+**   MININEZ_VM_PROFILE  1 to count as well and report every call, return
+**                       and failure to ctx->profile (see profile.h)
+**   MININEZ_VM_SWITCH   1 to dispatch with a switch instead of the table
+**                       of label addresses (indirect threading)
+**   MININEZ_VM_DIRECT   1 to run the direct-threaded code of the grammar
+**                       (see mininez_ThreadGrammar): the slots hold the
+**                       handler addresses and pre-resolved operands, so
+**                       a dispatch is one load and one jump. Called with
+**                       a NULL ctx, the function returns its handler
+**                       table for the translation.
+**   MININEZ_VM_REPARSE  1 to look every call up in ctx->reparse (see
+**                       reparse.h) instead of ctx->memo, and to track
+**                       the bytes each call examines for it
+**   MININEZ_VM_COMPACT  1 to keep the backtrack frames in 32-bit words
+**                       (input offsets and instruction indices) for
+**                       inputs under 4 GB; not with TRACE, STREAM, AST
+**                       or PROFILE, whose frames are read elsewhere
+*/
+
+#ifndef MININEZ_VM_EXECUTE
+#error please define MININEZ_VM_EXECUTE
+#endif
+#ifndef MININEZ_VM_TRACE
+#define MININEZ_VM_TRACE 0
+#endif
+#ifndef MININEZ_VM_STREAM
+#define MININEZ_VM_STREAM 0
+#endif
+#ifndef MININEZ_VM_AST
+#define MININEZ_VM_AST 0
+#endif
+#ifndef MININEZ_VM_COUNT
+#define MININEZ_VM_COUNT 0
+#endif
+#ifndef MININEZ_VM_PROFILE
+#define MININEZ_VM_PROFILE 0
+#endif
+#ifndef MININEZ_VM_SWITCH
+#define MININEZ_VM_SWITCH 0
+#endif
+#ifndef MININEZ_VM_DIRECT
+#define MININEZ_VM_DIRECT 0
+#endif
+#ifndef MININEZ_VM_COMPACT
+#define MININEZ_VM_COMPACT 0
+#endif
+#ifndef MININEZ_VM_REPARSE
+#define MININEZ_VM_REPARSE 0
+#endif
+#if MININEZ_VM_PROFILE == 1
+#undef MININEZ_VM_COUNT
+#define MININEZ_VM_COUNT 1
+#endif
+
+/*
+** Operands: ARG is the raw one; TARGET, STR, ROW and FIRST are what the
+** handlers use, resolved from an index here and at translation time in
+** the direct-threaded code.
+*/
+#if MININEZ_VM_DIRECT == 1
+#define VM_CODE MiniNezThreaded
+#define ARG(PC) ((PC)->u.arg)
+#define TARGET(PC) ((PC)->u.target)
+#define STR(PC) ((PC)->u.str)
+#define ROW(PC) ((PC)->u.row)
+#define CLASS(PC) (&classes[(size_t)((PC)->u.row - class_sets) >> class_shift])
+#define FIRST(PC, C) ((PC)->u.table[C])
+#else
+#define VM_CODE MiniNezInstruction
+#define ARG(PC) ((PC)->arg)
+#define TARGET(PC) (code + (PC)->arg)
+#define STR(PC) (strs[(PC)->arg])
+#define ROW(PC) SET_ROW((PC)->arg)
+#define CLASS(PC) (&classes[(PC)->arg])
+#define FIRST(PC, C) (code + jump_tables[(PC)->arg].target[C])
+#endif
+/* the nonterminal in the extension word of Icall */
+#define NTERM(PC) ARG((PC) + 1)
+
+/*
+** Backtrack frames: an alt frame is [pos][jmp][failPoint], a call frame
+** [jmp] and a pos frame [pos]. The wide frames hold longs and pointers
+** (or a StackEntry each); the compact ones hold 32-bit input offsets and
+** instruction indices, and link an alt frame to the previous one by its
+** distance in words.
+*/
+#if MININEZ_VM_COMPACT == 1
+#if MININEZ_VM_TRACE == 1 || MININEZ_VM_STREAM == 1 || MININEZ_VM_AST == 1 || MININEZ_VM_PROFILE == 1
+#error compact frames are only for the plain loops
+#endif
+#define FRAME uint32_t
+#define STACK_TOP (ctx->stack_pointer32)
+#define FRAME_POS(FP) ((FP)[0])
+#define FRAME_JMP(FP) (code + (FP)[1])
+#define FRAME_NEXT(FP) ((FP) - (FP)[2])
+#define PUSH_FRAME(POS, JMP, FP) push_alt32(ctx, POS, (uint32_t)((JMP) - code), FP)
+#define PUSH_POS(POS) push_pos32(ctx, POS)
+#define PUSH_CALL(JMP) push_call32(ctx, (uint32_t)((JMP) - code))
+#define POP_JMP() (code + pop_index32(ctx))
+#define POP_POS() pop_pos32(ctx)
+#elif USE_STACK_ENTRY == 1
+#define FRAME struct StackEntry
+#define STACK_TOP (ctx->stack_pointer)
+#define FRAME_POS(FP) ((FP)->pos)
+#define FRAME_JMP(FP) ((VM_CODE *)(FP)->jmp)
+#define FRAME_NEXT(FP) ((FP)->failPoint)
+#define PUSH_FRAME(POS, JMP, FP) push_alt(ctx, POS, JMP, FP)
+#define PUSH_POS(POS) push_pos(ctx, POS)
+#define PUSH_CALL(JMP) push_call(ctx, JMP)
+#define POP_JMP() ((VM_CODE *)pop_jmp(ctx))
+#define POP_POS() pop_pos(ctx)
+#else
+#define FRAME long
+#define STACK_TOP (ctx->stack_pointer)
+#define FRAME_POS(FP) ((FP)[0])
+#define FRAME_JMP(FP) ((VM_CODE *)(FP)[1])
+#define FRAME_NEXT(FP) ((long *)(FP)[2])
+#define PUSH_FRAME(POS, JMP, FP) push_alt(ctx, POS, JMP, FP)
+#define PUSH_POS(POS) push_pos(ctx, POS)
+#define PUSH_CALL(JMP) push_call(ctx, JMP)
+#define POP_JMP() ((VM_CODE *)pop_jmp(ctx))
+#define POP_POS() pop_pos(ctx)
+#endif
+
+long MININEZ_VM_EXECUTE(Context ctx, MiniNezInstruction *inst) {
+#if MININEZ_VM_SWITCH == 0
+#define LABEL(OP)          MININEZ_OP_##OP
+  static const void *__table[] = {
+#define DEFINE_TABLE(OP) &&LABEL(OP),
+    MININEZ_IR_EACH(DEFINE_TABLE)
+#undef DEFINE_TABLE
+  };
+#endif
+#if MININEZ_VM_DIRECT == 1
+  if (ctx == NULL) {
+    return (long)(uintptr_t)__table;
+  }
+  register VM_CODE *code = ctx->grammar->threaded;
+#else
+  register VM_CODE *code = inst;
+#endif
+  register const char *cur = ctx->inputs;
+  register VM_CODE *pc;
+  register long pos = 0;
+  const uint8_t *byte_class = ctx->grammar->byte_class;
+  const uint8_t *class_sets = ctx->grammar->class_sets;
+  unsigned class_shift = ctx->grammar->class_shift;
+  charclass_t *classes = ctx->grammar->classes;
+  int charclass_kernel = ctx->grammar->charclass_kernel;
+#if MININEZ_VM_DIRECT != 1
+  const char **strs = ctx->grammar->strs;
+  MiniNezJumpTable *jump_tables = ctx->grammar->jump_tables;
+#endif
+  register FRAME *failPoint = STACK_TOP;
+#if MININEZ_VM_TRACE == 1
+  size_t max_stack_size = 0;
+#endif
+#if MININEZ_VM_TRACE == 1 || MININEZ_VM_COUNT == 1
+  size_t dispatch_count = 0;
+#endif
+#if MININEZ_VM_REPARSE == 1
+  /* the end of the bytes examined since the innermost open call */
+  long reach = 0;
+  long lookahead = (long)ctx->reparse->lookahead;
+#endif
+
+#if MININEZ_VM_SWITCH == 1
+#define LABEL(OP)          case MININEZ_OP_##OP
+#define DISPATCH_START(PC) ++(PC); L_vm_head: switch ((PC)->op) {
+#define DISPATCH_END()     default: return 0; }
+#define DISPATCH_NEXT()    do { ++pc; goto L_vm_head; } while(0)
+#define JUMP(PC)           do { (void)(PC); goto L_vm_head; } while(0)
+#elif MININEZ_VM_DIRECT == 1
+#define DISPATCH_START(PC) DISPATCH_NEXT()
+#define DISPATCH_END()
+#define DISPATCH_NEXT()    goto *(++pc)->handler
+#define JUMP(PC)           goto *(PC)->handler
+#else
+#define DISPATCH_START(PC) DISPATCH_NEXT()
+#define DISPATCH_END()
+#define DISPATCH_NEXT()    goto *__table[(++pc)->op]
+#define JUMP(PC)           goto *__table[(PC)->op]
+#endif
+#define fail() goto L_fail
+#define FAIL_IMPL() do {\
+  FRAME* fp = (failPoint);\
+  PROFILE_FAIL(fp, FRAME_POS(fp));\
+  REACH(pos);\
+  pos = FRAME_POS(fp);\
+  pc = FRAME_JMP(fp);\
+  failPoint = FRAME_NEXT(fp);\
+  STACK_TOP = fp;\
+  STREAM_UNMARK();\
+  AST_ROLLBACK();\
+  JUMP(pc);\
+} while(0)
+#define RET(PC) JUMP(pc = PC)
+
+#if MININEZ_VM_AST == 1
+#define PUSH_ALT(POS, JMP, FP) (PUSH_POS((long)ctx->ast->log_size), PUSH_FRAME(POS, JMP, FP))
+#define AST_ROLLBACK() ast_rollback(ctx->ast, (size_t)POP_POS())
+#define AST_COMMIT() POP_POS()
+#define AST_SKIP() (FRAME_POS(failPoint - 1) = (long)ctx->ast->log_size)
+#else
+#define PUSH_ALT(POS, JMP, FP) PUSH_FRAME(POS, JMP, FP)
+#define AST_ROLLBACK()
+#define AST_COMMIT()
+#define AST_SKIP()
+#endif
+
+/*
+** pos only moves back on failure and Iback, and every instruction looks
+** at most lookahead bytes past it, so recording it there is enough.
+*/
+#if MININEZ_VM_REPARSE == 1
+#define REACH(P) do { if ((P) + lookahead > reach) reach = (P) + lookahead; } while(0)
+#else
+#define REACH(P)
+#endif
+
+/*
+** Streaming: ctx->stream_mark is the lowest Ipos save on the stack, which
+** the Ipos saves above it cannot outlive, and the input is released as
+** pos moves on through a loop or a scan.
+*/
+#if MININEZ_VM_STREAM == 1
+#define STREAM_MARK() do { if (ctx->stream_mark == NULL) ctx->stream_mark = STACK_TOP; } while(0)
+#define STREAM_UNMARK() do {\
+  if ((char *)STACK_TOP <= (char *)ctx->stream_mark) ctx->stream_mark = NULL;\
+} while(0)
+#define STREAM_RELEASE() do {\
+  if (pos >= ctx->stream_next) mininez_StreamRelease(ctx, failPoint, pos);\
+} while(0)
+#else
+#define STREAM_MARK()
+#define STREAM_UNMARK()
+#define STREAM_RELEASE()
+#endif
+
+/* a frame opened at the call closes when the stack drops below its mark */
+#if MININEZ_VM_PROFILE == 1
+#define PROFILE_CALL(NTERM) profile_enter(ctx->profile, NTERM, ctx->stack_pointer, pos, dispatch_count)
+#define PROFILE_RETURN() profile_leave(ctx->profile, ctx->stack_pointer, pos, dispatch_count, 0)
+#define PROFILE_FAIL(FP, BACK) profile_backtrack(ctx->profile, FP, pos, BACK, dispatch_count)
+#else
+#define PROFILE_CALL(NTERM)
+#define PROFILE_RETURN()
+#define PROFILE_FAIL(FP, BACK)
+#endif
+
+/* set membership through the byte equivalence classes */
+#define SET_ROW(S) (class_sets + ((size_t)(S) << class_shift))
+#define SET_HAS(ROW, C) \
+  (((ROW)[byte_class[(uint8_t)(C)] >> 3] >> (byte_class[(uint8_t)(C)] & 7)) & 1)
+
+#define OP_CASE_(OP) LABEL(OP):
+
+#if MININEZ_VM_TRACE == 1
+#define OP_CASE(OP) OP_CASE_(OP); TRACE_INST();
+#define TRACE_INST() do {\
+  size_t used = ctx->stack_pointer - ctx->stack_pointer_base;\
+  if (used > max_stack_size) {\
+    max_stack_size = used;\
+  }\
+  dispatch_count++;\
+  fprintf(stderr, "[%ld] %s (pos:%ld)\n", (long)(pc - code), get_opname(pc->op), pos);\
+} while(0)
+#elif MININEZ_VM_COUNT == 1
+#define OP_CASE(OP) OP_CASE_(OP); dispatch_count++;
+#else
+#define OP_CASE(OP) OP_CASE_(OP)
+#endif
+
+  if (ctx->memo) {
+    memo_reset(ctx->memo);
+  }
+  failPoint = PUSH_ALT(pos, code + MININEZ_INST_EXIT_FAIL, STACK_TOP);
+  PUSH_CALL(code + MININEZ_INST_EXIT_SUCC);
+  pc = code + ctx->grammar->entries[ctx->entry].addr - 1;
+  DISPATCH_START(pc);
+
+  OP_CASE(Iexit) {
+    ctx->pos = pos;
+#if MININEZ_VM_TRACE == 1
+    fprintf(stderr, "exit %d\n", (int)ARG(pc));
+    fprintf(stderr, "stack_usage: %lu[byte]\n", max_stack_size * sizeof(*ctx->stack_pointer));
+    fprintf(stderr, "dispatch: %zu\n", dispatch_count);
+#endif
+#if MININEZ_VM_TRACE == 1 || MININEZ_VM_COUNT == 1
+    ctx->dispatch_count = dispatch_count;
+#endif
+    return (long)ARG(pc);
+  }
+  OP_CASE(Inop) {
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ifail) {
+  L_fail:
+    FAIL_IMPL();
+  }
+  OP_CASE(Ialt) {
+    failPoint = PUSH_ALT(pos, TARGET(pc), failPoint);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Isucc) {
+    STACK_TOP = failPoint;
+    STREAM_UNMARK();
+    failPoint = FRAME_NEXT(failPoint);
+    AST_COMMIT();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ijump) {
+    JUMP(pc = TARGET(pc));
+  }
+  OP_CASE(Icall) {
+    PROFILE_CALL(NTERM(pc));
+#if MININEZ_VM_REPARSE == 1
+    {
+      unsigned nterm = (unsigned)NTERM(pc);
+      ReparseEntry *entry = reparse_lookup(ctx->reparse, nterm, pos);
+      if (entry) {
+        if (pos + (long)entry->examined > reach) {
+          reach = pos + (long)entry->examined;
+        }
+        if (entry->consumed == REPARSE_FAIL) {
+          fail();
+        }
+        pos += entry->consumed;
+        RET(pc+2);
+      }
+      /* [nterm][reach of the caller][return address][alt frame][Imemosucc] */
+      PUSH_POS(nterm);
+      PUSH_POS(reach);
+      PUSH_CALL(pc+2);
+      reach = pos + lookahead;
+      failPoint = PUSH_ALT(pos, code + MININEZ_INST_MEMO_FAIL, failPoint);
+      PUSH_CALL(code + MININEZ_INST_MEMO_SUCC);
+      JUMP(pc = TARGET(pc));
+    }
+#endif
+    /* a memo hit would skip the tree operations of the callee */
+    if (MININEZ_VM_AST == 0 && ctx->memo) {
+      unsigned nterm = (unsigned)NTERM(pc);
+      MemoEntry *entry = memo_lookup(ctx->memo, nterm, pos);
+      if (entry) {
+        if (entry->consumed == MEMO_FAIL) {
+          fail();
+        }
+        pos = entry->consumed;
+        PROFILE_RETURN();
+        RET(pc+2);
+      }
+      /*
+      ** [nterm][return address][alt frame][Imemosucc]
+      ** Imemosucc and Imemofail unwind this frame and record the result.
+      */
+      PUSH_POS(nterm);
+      PUSH_CALL(pc+2);
+      failPoint = PUSH_ALT(pos, code + MININEZ_INST_MEMO_FAIL, failPoint);
+      PUSH_CALL(code + MININEZ_INST_MEMO_SUCC);
+      JUMP(pc = TARGET(pc));
+    }
+    PUSH_CALL(pc+2);
+    JUMP(pc = TARGET(pc));
+  }
+  OP_CASE(Iret) {
+    VM_CODE* tmp = POP_JMP();
+    PROFILE_RETURN();
+    RET(tmp);
+  }
+  OP_CASE(Ipos) {
+    STREAM_MARK();
+    PUSH_POS(pos);
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Iback) {
+    REACH(pos);
+    pos = POP_POS();
+    STREAM_UNMARK();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Iskip) {
+  L_skip:
+    /* the loop makes no progress since the last iteration */
+    if(pos == FRAME_POS(failPoint)) {
+      fail();
+    }
+    FRAME_POS(failPoint) = pos;
+    AST_SKIP();
+    STREAM_RELEASE();
+    JUMP(pc = TARGET(pc));
+  }
+  OP_CASE(Ibyte) {
+    if((uint8_t)cur[pos] != ARG(pc)) {
+      fail();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Iany) {
+    if(cur[pos] == 0) {
+      fail();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Istr) {
+    const char* str = STR(pc);
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(cur+pos, str, len) == 0) {
+      fail();
+    }
+    pos += len;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Iset) {
+    if (!SET_HAS(ROW(pc), cur[pos])) {
+      fail();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Inbyte) {
+    if((uint8_t)cur[pos] != ARG(pc)) {
+      DISPATCH_NEXT();
+    }
+    fail();
+  }
+	OP_CASE(Instr) {
+    const char* str = STR(pc);
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(cur+pos, str, len) == 0) {
+      DISPATCH_NEXT();
+    }
+    fail();
+  }
+  OP_CASE(Iostr) {
+    const char* str = STR(pc);
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(cur+pos, str, len) == 0) {
+      DISPATCH_NEXT();
+    }
+    pos += len;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ioset) {
+    if (!SET_HAS(ROW(pc), cur[pos])) {
+      DISPATCH_NEXT();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Irset) {
+    const uint8_t *row = ROW(pc);
+    unsigned n = 0;
+    while (SET_HAS(row, cur[pos])) {
+      ++pos;
+      /* long runs go to the vector scan; it stops at the NUL sentinel */
+      if (++n == CHARCLASS_SCALAR_PREFIX && charclass_kernel != CHARCLASS_SCALAR
+          && !SET_HAS(row, 0)) {
+        pos += charclass_scan(charclass_kernel, CLASS(pc), cur + pos);
+        break;
+      }
+    }
+    STREAM_RELEASE();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ilabel) {
+#if MININEZ_VM_TRACE == 1
+    fprintf(stderr, "%s\n", ctx->grammar->nterms[ARG(pc)]);
+#endif
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Imemofail) {
+    /* FAIL_IMPL has already restored pos and popped the alt frame */
+    (void)POP_JMP();
+#if MININEZ_VM_REPARSE == 1
+    long caller = POP_POS();
+    unsigned nterm = (unsigned)POP_POS();
+    reparse_store(ctx->reparse, nterm, pos, REPARSE_FAIL, (size_t)(reach - pos));
+    if (caller > reach) {
+      reach = caller;
+    }
+#else
+    unsigned nterm = (unsigned)POP_POS();
+    memo_store(ctx->memo, nterm, pos, MEMO_FAIL);
+#endif
+    fail();
+  }
+  OP_CASE(Imemosucc) {
+    long start = FRAME_POS(failPoint);
+    STACK_TOP = failPoint;
+    STREAM_UNMARK();
+    failPoint = FRAME_NEXT(failPoint);
+    AST_COMMIT();
+    VM_CODE* ret = POP_JMP();
+#if MININEZ_VM_REPARSE == 1
+    long caller = POP_POS();
+    unsigned nterm = (unsigned)POP_POS();
+    REACH(pos);
+    reparse_store(ctx->reparse, nterm, start, (uint32_t)(pos - start), (size_t)(reach - start));
+    if (caller > reach) {
+      reach = caller;
+    }
+#else
+    unsigned nterm = (unsigned)POP_POS();
+    memo_store(ctx->memo, nterm, start, pos);
+#endif
+    PROFILE_RETURN();
+    RET(ret);
+  }
+  OP_CASE(Inew) {
+#if MININEZ_VM_AST == 1
+    ast_log(ctx->ast, AST_LOG_NEW, pos);
+#endif
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Itag) {
+#if MININEZ_VM_AST == 1
+    ast_log(ctx->ast, AST_LOG_TAG, ARG(pc));
+#endif
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ilink) {
+#if MININEZ_VM_AST == 1
+    ast_log(ctx->ast, AST_LOG_LINK, 0);
+#endif
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Icapture) {
+#if MININEZ_VM_AST == 1
+    ast_log(ctx->ast, AST_LOG_CAPTURE, pos);
+#endif
+    DISPATCH_NEXT();
+  }
+  /* superinstructions built by the loader's peephole pass */
+  OP_CASE(Inbyteany) {
+    if((uint8_t)cur[pos] == ARG(pc) || cur[pos] == 0) {
+      fail();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Instrany) {
+    const char* str = STR(pc);
+    unsigned len = pstring_length(str);
+    if (pstring_starts_with(cur+pos, str, len) != 0 || cur[pos] == 0) {
+      fail();
+    }
+    ++pos;
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ifirst) {
+    /* enter the choice at the first alternative the next byte can start */
+    JUMP(pc = FIRST(pc, (uint8_t)cur[pos]));
+  }
+  OP_CASE(Iscanbyte) {
+    pos = pstring_scan_byte(cur + pos, (uint8_t)ARG(pc)) - cur;
+    STREAM_RELEASE();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Iscanstr) {
+    const char* str = STR(pc);
+    pos = pstring_scan_str(cur + pos, str, pstring_length(str)) - cur;
+    STREAM_RELEASE();
+    DISPATCH_NEXT();
+  }
+  OP_CASE(Ianyskip) {
+    if(cur[pos] == 0) {
+      fail();
+    }
+    ++pos;
+    goto L_skip;
+  }
+  DISPATCH_END();
+  return 0;
+}
+
+#undef DISPATCH_NEXT
+#undef DISPATCH_START
+#undef DISPATCH_END
+#undef LABEL
+#undef fail
+#undef FAIL_IMPL
+#undef JUMP
+#undef VM_CODE
+#undef ARG
+#undef TARGET
+#undef STR
+#undef ROW
+#undef CLASS
+#undef FIRST
+#undef NTERM
+#undef FRAME
+#undef STACK_TOP
+#undef FRAME_POS
+#undef FRAME_JMP
+#undef FRAME_NEXT
+#undef PUSH_FRAME
+#undef PUSH_POS
+#undef PUSH_CALL
+#undef POP_JMP
+#undef POP_POS
+#undef RET
+#undef OP_CASE_
+#undef OP_CASE
+#undef TRACE_INST
+#undef PUSH_ALT
+#undef AST_ROLLBACK
+#undef AST_COMMIT
+#undef AST_SKIP
+#undef SET_ROW
+#undef SET_HAS
+#undef PROFILE_CALL
+#undef PROFILE_RETURN
+#undef PROFILE_FAIL
+#undef REACH
+#undef STREAM_MARK
+#undef STREAM_UNMARK
+#undef STREAM_RELEASE
+
+#undef MININEZ_VM_EXECUTE
+#undef MININEZ_VM_TRACE
+#undef MININEZ_VM_STREAM
+#undef MININEZ_VM_AST
+#undef MININEZ_VM_COUNT
+#undef MININEZ_VM_PROFILE
+#undef MININEZ_VM_SWITCH
+#undef MININEZ_VM_DIRECT
+#undef MININEZ_VM_COMPACT
+#undef MININEZ_VM_REPARSE